@@ -24,6 +24,14 @@ SOFTWARE.
 
 
 // ann.h - Artificial Neural Nework
+//
+// The network is written once, in the ANN_TEMPLATE section, against fp_t, ann_t
+// and ann_*(). ann.h includes itself to build it in double precision ( fp_t,
+// ann_t, ann_*() ) and in single precision ( fpf_t, annf_t, annf_*() ), so both
+// can be used from the same translation unit.
+
+
+#ifndef ANN_TEMPLATE
 
 
 #ifndef ANN_H
@@ -34,6 +42,7 @@ SOFTWARE.
 
 
 typedef double fp_t;
+typedef float fpf_t;
 typedef uint32_t uint_t;
 typedef int32_t int_t;
 
@@ -47,69 +56,146 @@ typedef enum
     ELU,
     LRELU,
     TANH,
+    SIGMOID_FAST,
+    ELU_FAST,
+    TANH_FAST,
+
+    // Output layer only, trained against the cross-entropy error
+    SOFTMAX,
 } ann_activation_t;
 
 
+typedef enum
+{
+    SGD,
+    MOMENTUM,
+    ADAM,
+} ann_optimizer_t;
+
+
+// Weight initialization, see ann_random_init()
+typedef enum
+{
+    UNIFORM,    // U( -1, 1 )
+    XAVIER,     // U( -a, a ), a = sqrt( 6 / ( fan_in + fan_out ) )
+    HE,         // N( 0, sqrt( 2 / fan_in ) )
+} ann_initializer_t;
+
+
+// Weight storage of ann_half_t, see ann_half_init()
+typedef enum
+{
+    FP16,       // IEEE 754 binary16, 5 exponent and 10 mantissa bits
+    BF16,       // bfloat16, the upper half of a binary32
+} ann_half_format_t;
+
+
+// The first two words of every network and saved model, so ann_load() and
+// ann_map() only accept files written by ann_save() of this layout. The
+// version is raised whenever ann_t or the order of its arrays changes.
+
+#define ANN_MAGIC 0x004e4e41    // "ANN\0" in little endian
+#define ANN_VERSION 1
+
+
+// Eight interleaved xoshiro256+ generators, stepped together so a block of
+// eight outputs costs a few vector instructions. Not shared between threads,
+// each thread takes its own stream of the same seed, see ann_rng_init().
+
+#define ANN_RNG_LANE_N 8
+
 typedef struct
 {
-	// The full size of the allocated structure
-	uint_t n;
+	uint64_t s[4][ANN_RNG_LANE_N];
 
-	// The number of layers in the neural network
-	uint_t layer_n;
+	// The block being handed out by ann_rng_next(), from buffer_i on
+	uint64_t buffer[ANN_RNG_LANE_N];
+	uint_t buffer_i;
+} ann_rng_t;
 
-	// The neuron count ( hidden )
-	uint_t neuron_n;
 
-	// The total number of weights and biases
-	uint_t weight_n;
+void ann_rng_init( ann_rng_t *, uint64_t, uint64_t );
+uint64_t ann_rng_next( ann_rng_t * );
 
-	// The number of neurons in each layer
-	uint_t *layer_neuron_n;
 
-	// The pointer to the neurons
-    fp_t *neuron;
+// What ann_benchmark() times for every sample
+typedef enum
+{
+    BENCHMARK_FORWARD,      // ann_propagation_forward(), or _batch() for batches
+    BENCHMARK_BACKWARD,     // forward and ann_propagation_backward(), or ann_train_batch()
+    BENCHMARK_NUMERIC,      // ann_train_numeric()
+} ann_benchmark_mode_t;
 
-	// The weights and biases for each neuron
-	//   - w_lji denotes the connection between the jth neuron in layer l, and
-	//     the ith connection in the previous layer
-	//   - b_lj denotes the bias for the jth neuron in layer l
-	// { w_000, w_001, w_002, .... , b_00, ...., w_ijk, b_ij }
-	fp_t *weight;
 
-	// The delta between between the actual and the cost function
-	fp_t *delta;
+typedef struct
+{
+	// Nanoseconds per sample, the median and 99th percentile over the runs
+	double median;
+	double p99;
 
-	// The activation function used in the hidden layer neurons
-	fp_t ( *activation_hidden ) ( fp_t );
+	// Floating point operations and bytes of memory traffic per sample,
+	// estimated from the topology, see ann_benchmark()
+	double flop;
+	double byte;
 
-	// The partial derivative of the activation function used in the hidden
-	// layer neurons
-	fp_t ( *activation_hidden_partial ) ( fp_t );
+	// flop / median
+	double gflops;
+} ann_benchmark_t;
 
-	// The activation function used in the ouput neurons
-	fp_t ( *activation_output ) ( fp_t );
 
-	// The partial derivative of the activation function used in the output
-	// layer neurons
-	fp_t ( *activation_output_partial ) ( fp_t );
-} ann_t;
+#ifdef ANN_THREAD
 
+#include <pthread.h>
 
-ann_t * ann_init( uint_t, uint_t * );
-ann_t * ann_copy( ann_t const * );
-void ann_free( ann_t * );
-void ann_random( ann_t * );
+// The serving queue waits for its deadlines on CLOCK_MONOTONIC, set through
+// pthread_condattr_setclock(), which strict C modes only declare when asked
+#if !defined( _POSIX_C_SOURCE ) || _POSIX_C_SOURCE < 200112L
+#error "ANN_THREAD needs _POSIX_C_SOURCE 200112L or later, define it or build in a gnu mode"
+#endif
 
-void ann_propagation_forward( ann_t *, fp_t const * const, fp_t * );
-void ann_propagation_backward( ann_t *, fp_t const *, fp_t *, fp_t const *, fp_t );
-void ann_train_numeric( ann_t *, fp_t const *, fp_t const *, fp_t );
+// Persistent thread pool, see ann_pool_run()
+typedef struct ann_pool_t ann_pool_t;
 
-fp_t ann_error_total( fp_t const *, fp_t const *, uint_t );
-void ann_set_activation( ann_t *, ann_activation_t, ann_activation_t );
+ann_pool_t * ann_pool_init( uint_t );
+void ann_pool_free( ann_pool_t * );
+uint_t ann_pool_thread_n( ann_pool_t const * );
+void ann_pool_run( ann_pool_t *, void ( * )( void *, uint_t, uint_t ), void * );
 
-void ann_print_weight( ann_t * );
-void ann_print_neuron( ann_t *, fp_t const * const, fp_t const * const );
+
+// Latency of the requests through a batching queue, see ann_queue_stats()
+typedef struct
+{
+	// Requests completed and batches run since the queue was made
+	uint64_t request_n;
+	uint64_t batch_n;
+
+	// Seconds from submission to completion over the most recent requests
+	double p50;
+	double p99;
+} ann_queue_stats_t;
+
+#endif // ANN_THREAD
+
+
+#define ANN_TEMPLATE
+
+#define ANN_FP double
+#define ANN_NAME( name ) ann_ ## name
+#include "ann.h"
+#undef ANN_FP
+#undef ANN_NAME
+
+#define ANN_FP float
+#define ANN_NAME( name ) annf_ ## name
+#include "ann.h"
+#undef ANN_FP
+#undef ANN_NAME
+
+#undef ANN_TEMPLATE
+
+
+annf_t * ann_to_annf( ann_t const * );
+ann_t * annf_to_ann( annf_t const * );
 
 
 #endif // ANN_H
@@ -122,8 +208,17 @@ void ann_print_neuron( ann_t *, fp_t const * const, fp_t const * const );
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <float.h>
+#include <time.h>
 #include <tgmath.h>
 
+#if defined( __unix__ )
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 
 #define PRINT_PRECISION 10
 
@@ -136,412 +231,5300 @@ void ann_print_neuron( ann_t *, fp_t const * const, fp_t const * const );
 #define LRELU_ALPHA       0.2
 
 
-static fp_t ann_random_range( fp_t, fp_t );
-
-static fp_t ann_error( fp_t, fp_t );
-static fp_t ann_error_partial( fp_t, fp_t );
+////////////////////////////////////////////////////////////////////////////////
+// SIMD
+////////////////////////////////////////////////////////////////////////////////
 
-static fp_t ann_activation_identity( fp_t );
-static fp_t ann_activation_identity_partial( fp_t );
-static fp_t ann_activation_binary( fp_t );
-static fp_t ann_activation_binary_partial( fp_t );
-static fp_t ann_activation_sigmoid( fp_t );
-static fp_t ann_activation_sigmoid_partial( fp_t );
-static fp_t ann_activation_relu( fp_t );
-static fp_t ann_activation_relu_partial( fp_t );
-static fp_t ann_activation_elu( fp_t );
-static fp_t ann_activation_elu_partial( fp_t );
-static fp_t ann_activation_lrelu( fp_t );
-static fp_t ann_activation_lrelu_partial( fp_t );
-static fp_t ann_activation_tanh( fp_t );
-static fp_t ann_activation_tanh_partial( fp_t );
+// The dot product and axpy kernels are written with GCC vector extensions, a
+// vector being one cache line of fp_t. On x86-64 ELF targets target_clones
+// builds an AVX-512, AVX2 and baseline ( SSE2 ) variant of each kernel and the
+// loader picks one by CPUID at startup. Other compilers, or ANN_NO_SIMD, get
+// the scalar loops.
 
+#if defined( __GNUC__ ) && !defined( ANN_NO_SIMD )
+#define ANN_VECTOR
+#define ANN_LANE_N ( sizeof( ann_vector_t ) / sizeof( fp_t ) )
+#endif
 
-static fp_t ( *ACTIVATION[][2] )( fp_t ) = {
-    [IDENTITY] = { ann_activation_identity, ann_activation_identity_partial },
-    [BINARY] = { ann_activation_binary, ann_activation_binary_partial },
-    [SIGMOID] = { ann_activation_sigmoid, ann_activation_sigmoid_partial },
-    [RELU] = { ann_activation_relu, ann_activation_relu_partial },
-    [ELU] = { ann_activation_elu, ann_activation_elu_partial },
-    [LRELU] = { ann_activation_lrelu, ann_activation_lrelu_partial },
-    [TANH] = { ann_activation_tanh, ann_activation_tanh_partial },
-};
+#if defined( ANN_VECTOR ) && defined( __x86_64__ ) && defined( __ELF__ )
+#define ANN_SIMD __attribute__(( target_clones( "avx512f", "avx2", "default" ) ))
+#else
+#define ANN_SIMD
+#endif
 
 
+// The size of the L2 cache in bytes, used to size the cache blocks of the layer
+// kernels. Read from sysconf() where it is available, once, and kept. Threads
+// racing on the first call all store the same value.
 
-ann_t * ann_init( uint_t layer_n, uint_t *layer_neuron_n )
+static uint_t ann_cache_size( void )
 {
-	assert( layer_n >= 2 );
+	static uint_t cache_size = 0;
 
-	uint_t neuron_n = 0;
-	uint_t weight_n = 0;
+#if defined( __GNUC__ )
+	uint_t n = __atomic_load_n( &cache_size, __ATOMIC_RELAXED );
+#else
+	uint_t n = cache_size;
+#endif
 
-	// Calculate the number of neurons and weights / biases
-	uint_t l = 1;
-	for( ; l < layer_n - 1; l++ )
+	if( n == 0 )
 	{
-		neuron_n += layer_neuron_n[l];
-		weight_n += layer_neuron_n[l] * (layer_neuron_n[l - 1] + 1);
+#ifdef _SC_LEVEL2_CACHE_SIZE
+		long size = sysconf( _SC_LEVEL2_CACHE_SIZE );
+
+		n = ( size > 0 ) ? ( uint_t ) size : 256 * 1024;
+#else
+		n = 256 * 1024;
+#endif
+
+#if defined( __GNUC__ )
+		__atomic_store_n( &cache_size, n, __ATOMIC_RELAXED );
+#else
+		cache_size = n;
+#endif
 	}
 
-	weight_n += layer_neuron_n[l] * (layer_neuron_n[l - 1] + 1);
-
-	uint_t n = sizeof( ann_t ) +                             // ANN
-		( sizeof( uint_t ) * layer_n ) +                     // layer_neuron_n[]
-		( sizeof( fp_t ) * ( neuron_n +                      // neuron[]
-		weight_n +                                      // weight[]
-		neuron_n + layer_neuron_n[layer_n - 1] ) );          // delta[]
+	return n;
+}
 
-	// Allocate everything as one structure
-	ann_t *ann = malloc( n );
-
-	// ann_t | layer_neuron_n[] | neuron[] | weight[] | delta[]
-	ann->n = n;
-	ann->layer_n = layer_n;
-	ann->weight_n = weight_n;
-	ann->neuron_n = neuron_n;
-	ann->layer_neuron_n = ( uint_t * ) ( ( uint8_t * ) ann + sizeof( ann_t ) );
-	memcpy( ann->layer_neuron_n, layer_neuron_n, sizeof( uint_t ) * layer_n );
-	ann->neuron = ( fp_t * ) ( ann->layer_neuron_n + ann->layer_n );
-	ann->weight = ann->neuron + ann->neuron_n;
-	ann->delta = ann->weight + ann->weight_n;
 
-	ann_set_activation(
-		ann,
-		SIGMOID,
-        SIGMOID
-	);
+// y = sum[0,n){ x_i * w_i } for int8 inputs and weights with int32 accumulation.
+// The products are formed as int16 and widened before being summed
 
-	return ann;
-}
+#ifdef ANN_VECTOR
+typedef int8_t ann_q8_vector_t __attribute__(( vector_size( 32 ) ));
+typedef int16_t ann_q16_vector_t __attribute__(( vector_size( 64 ) ));
+typedef int32_t ann_q32_vector_t __attribute__(( vector_size( 128 ) ));
+#endif
 
-void ann_free( ann_t *ann )
+ANN_SIMD static int32_t ann_dot_q8( int8_t const *x, int8_t const *w, uint_t n )
 {
-    free( ann );
-}
+	int32_t y = 0;
+	uint_t i = 0;
 
-ann_t * ann_copy( ann_t const *ann )
-{
-    ann_t *copy = malloc( ann->n );
-    memcpy( copy, ann, ann->n );
-    
-    return copy;
-}
+#ifdef ANN_VECTOR
+	ann_q32_vector_t y_v = { 0 };
+	ann_q8_vector_t x_v, w_v;
 
+	for( ; i + sizeof( ann_q8_vector_t ) <= n; i += sizeof( ann_q8_vector_t ) )
+	{
+		memcpy( &x_v, x + i, sizeof( ann_q8_vector_t ) );
+		memcpy( &w_v, w + i, sizeof( ann_q8_vector_t ) );
+
+		y_v += __builtin_convertvector(
+			__builtin_convertvector( x_v, ann_q16_vector_t ) *
+			__builtin_convertvector( w_v, ann_q16_vector_t ),
+			ann_q32_vector_t
+		);
+	}
 
-////////////////////////////////////////////////////////////////////////////////
-// FORWARD PROPAGATION
-////////////////////////////////////////////////////////////////////////////////
+	for( uint_t k = 0; k < sizeof( ann_q8_vector_t ); k++ )
+	{
+		y += y_v[k];
+	}
+#endif
 
-// o_j = s( sum[1,n+1]{w_ij * o_i} )
+	for( ; i < n; i++ )
+	{
+		y += ( int32_t ) x[i] * w[i];
+	}
 
-void ann_propagation_forward( ann_t *ann, fp_t const * const input, fp_t *output )
+	return y;
+}
+
+
+// Half precision conversion
+//
+// Rounds to nearest even. FP16 overflows to infinity beyond 65504 and rounds
+// below 2^-14 to its subnormals.
+
+static uint16_t ann_half_from_float( float x, ann_half_format_t format )
 {
-    fp_t *w_ij = ann->weight;
-	fp_t const *x = input;     // Input neuron into y. The type fp_t will be used to access neuron_t in the cas of STORE_USER
-	fp_t *y = ann->neuron;     // The current neuron being calculated
-	
-	uint_t l = 1;
+	uint32_t u;
 
-	// Hidden Layers
-	for( ; l < ann->layer_n - 1; l++ )
+	memcpy( &u, &x, sizeof( u ) );
+
+	uint32_t a = u & 0x7FFFFFFF;
+	uint16_t sign = ( u >> 16 ) & 0x8000;
+
+	if( format == BF16 )
 	{
-	    for( uint_t j = 0; j < ann->layer_neuron_n[l]; j++ )
-	    {
-            y[j] = 0;
-		    for( uint_t i = 0; i < ann->layer_neuron_n[l - 1]; i++ )
-		    {
-			    y[j] += x[i] * *w_ij++;
-		    }
-		    
-		    y[j] += *w_ij++;
-            y[j] = ann->activation_hidden( y[j] );
-	    }
+		return ( a > 0x7F800000 ) ?
+			( uint16_t ) ( ( u >> 16 ) | 0x40 ) :
+			( uint16_t ) ( ( u + 0x7FFF + ( ( u >> 16 ) & 1 ) ) >> 16 );
+	}
 
-        x = y;
-		y += ann->layer_neuron_n[l];
+	if( a > 0x7F800000 )
+	{
+		return sign | 0x7E00;
 	}
 
-	// Last layer
-    for( uint_t j = 0; j < ann->layer_neuron_n[l]; j++ )
-    {
-	    output[j] = 0;
+	if( a >= 0x477FF000 )
+	{
+		return sign | 0x7C00;
+	}
 
-	    for( uint_t i = 0; i < ann->layer_neuron_n[l - 1]; i++ )
-	    {
-		    output[j] += x[i] * *w_ij++;
-	    }
+	// x = m * 2^-24 for the subnormals, m rounding up to 0x400 for the smallest
+	// normal
+	if( a < 0x38800000 )
+	{
+		float f;
 
-	    output[j] += *w_ij++;
-	    output[j] = ann->activation_output( output[j] );
-    }
-}
+		memcpy( &f, &a, sizeof( f ) );
 
+		return sign | ( uint16_t ) rint( f * 0x1p24f );
+	}
 
-////////////////////////////////////////////////////////////////////////////////
-// TRAINING
-////////////////////////////////////////////////////////////////////////////////
+	// Rebias the exponent from 127 to 15 and round off 13 mantissa bits, a carry
+	// moving into the exponent
+	a -= 0x38000000;
 
-// E = 0.5 * sum[1, o_n+1]{ (o_i - t_i)^2 }
-// d_j = 
+	return sign | ( uint16_t ) ( ( a + 0xFFF + ( ( a >> 13 ) & 1 ) ) >> 13 );
+}
 
-void ann_propagation_backward( ann_t *ann, fp_t const *input, fp_t *output, fp_t const *target, fp_t rate )
+
+// The bits of an FP16 value moved into a binary32 are 2^-112 times its value,
+// the subnormals included, so one multiply rebiases every finite value.
+// Infinities and NaNs keep the largest exponent.
+
+static float ann_half_to_float( uint16_t h, ann_half_format_t format )
 {
-    int_t l = ann->layer_n - 1;
-    uint_t i, j, q;
-    
-    // First output layer delta
-	fp_t *d_j = ann->delta + ann->neuron_n;
+	uint32_t u = ( uint32_t ) h << 16;
+	float f;
 
-	// Output Deltas
-	for( j = 0; j < ann->layer_neuron_n[l]; j++ )
+	if( format == FP16 )
 	{
-		d_j[j] = ann->activation_output_partial( output[j] ) * ann_error_partial( output[j], target[j] );
-	}
+		u = ( uint32_t ) ( h & 0x7FFF ) << 13;
+		memcpy( &f, &u, sizeof( f ) );
+		f *= 0x1p112f;
+		memcpy( &u, &f, sizeof( u ) );
 
-	// First weight in the set between the last layer and the current
-	fp_t *w_jq = ann->weight +
-		ann->weight_n -
-		ann->layer_neuron_n[l] * ann->layer_neuron_n[l - 1] - 
-        ann->layer_neuron_n[l];
-
-	fp_t *o_j = ann->neuron + ann->neuron_n;
-	fp_t *d_q;
+		u |= ( ( h & 0x7C00 ) == 0x7C00 ) ? 0x7F800000 : 0;
+		u |= ( uint32_t ) ( h & 0x8000 ) << 16;
+	}
 
-	l--;
+	memcpy( &f, &u, sizeof( f ) );
 
-	// Hidden Deltas
-	for( ; l > 0; --l )
-	{
-		d_q = d_j;
-		d_j -= ann->layer_neuron_n[l];
-   		o_j -= ann->layer_neuron_n[l];
+	return f;
+}
 
-		for( j = 0; j < ann->layer_neuron_n[l]; j++ )
-		{
-			d_j[j] = 0;
 
-			for( q = 0; q < ann->layer_neuron_n[l + 1]; q++ )
-			{
-				d_j[j] += w_jq[q * ( ann->layer_neuron_n[l] + 1 ) + j] * d_q[q];
-			}
+// y = sum[0,n){ x_i * w_i } for half precision weights, widened to float and
+// accumulated in float over 16 lanes
 
-			d_j[j] *= ann->activation_hidden_partial( o_j[j] );
-		}
+#define ANN_HALF_LANE_N 16
 
-		w_jq -= ( ann->layer_neuron_n[l - 1] * ann->layer_neuron_n[l] +	ann->layer_neuron_n[l - 1] );
-	}
+#ifdef ANN_VECTOR
+typedef uint16_t ann_h16_vector_t __attribute__(( vector_size( 2 * ANN_HALF_LANE_N ) ));
+typedef uint32_t ann_h32_vector_t __attribute__(( vector_size( 4 * ANN_HALF_LANE_N ) ));
+typedef float ann_f32_vector_t __attribute__(( vector_size( 4 * ANN_HALF_LANE_N ) ));
+#endif
 
-	fp_t *w_ij = ann->weight;
-	d_j = ann->delta;
+ANN_SIMD static float ann_dot_fp16( float const *x, uint16_t const *w, uint_t n )
+{
+	float y = 0;
+	uint_t i = 0;
 
-    l = 1;
+#ifdef ANN_VECTOR
+	ann_f32_vector_t y_v = { 0 };
+	ann_f32_vector_t x_v, w_v;
+	ann_h16_vector_t h_v;
+	ann_h32_vector_t u_v, e_v;
 
-	// Input training
-	for( j = 0; j < ann->layer_neuron_n[l]; j++ )
+	for( ; i + ANN_HALF_LANE_N <= n; i += ANN_HALF_LANE_N )
 	{
-		for( i = 0; i < ann->layer_neuron_n[l - 1]; i++ )
-		{
-			*w_ij -= rate * input[i] * d_j[j];
-            w_ij++;
-		}
-        
-		*w_ij -= rate * d_j[j];
-        w_ij++;
+		memcpy( &x_v, x + i, sizeof( ann_f32_vector_t ) );
+		memcpy( &h_v, w + i, sizeof( ann_h16_vector_t ) );
+
+		// As ann_half_to_float()
+		u_v = __builtin_convertvector( h_v, ann_h32_vector_t );
+		e_v = ( u_v & 0x7FFF ) << 13;
+		memcpy( &w_v, &e_v, sizeof( ann_f32_vector_t ) );
+		w_v *= 0x1p112f;
+		memcpy( &e_v, &w_v, sizeof( ann_h32_vector_t ) );
+		e_v |= ( ann_h32_vector_t ) ( ( u_v & 0x7C00 ) == 0x7C00 ) & 0x7F800000;
+		e_v |= ( u_v & 0x8000 ) << 16;
+		memcpy( &w_v, &e_v, sizeof( ann_f32_vector_t ) );
+
+		y_v += x_v * w_v;
 	}
 
-	l++;
-	fp_t *i_i = ann->neuron;
-
-	// Hidden training
-	for( ; l < ( int_t ) ann->layer_n; l++ )
+	for( uint_t k = 0; k < ANN_HALF_LANE_N; k++ )
 	{
-		d_j += ann->layer_neuron_n[l - 1];
-
-		for( j = 0; j < ann->layer_neuron_n[l]; j++ )
-		{
-			for( i = 0; i < ann->layer_neuron_n[l - 1]; i++ )
-			{
-				*w_ij -= rate * i_i[i] * d_j[j];
-                w_ij++;
-			}
+		y += y_v[k];
+	}
+#endif
 
-			*w_ij -= rate * d_j[j];
-            w_ij++;
-		}
-    
-		i_i += ann->layer_neuron_n[l - 1];
+	for( ; i < n; i++ )
+	{
+		y += x[i] * ann_half_to_float( w[i], FP16 );
 	}
+
+	return y;
 }
 
 
-void ann_train_numeric( ann_t *ann, fp_t const *input, fp_t const *target, fp_t rate )
+ANN_SIMD static float ann_dot_bf16( float const *x, uint16_t const *w, uint_t n )
 {
-    const fp_t EPSILON = 1e-8;
+	float y = 0;
+	uint_t i = 0;
 
-    fp_t *weight_numerical = malloc( sizeof( fp_t ) * ann->weight_n );
-    uint_t output_n = ann->layer_neuron_n[ann->layer_n - 1];
-    fp_t lower[output_n], upper[output_n];
-    fp_t *wbn = weight_numerical;
-    fp_t *wb = ann->weight;
-    fp_t original, gradient;
+#ifdef ANN_VECTOR
+	ann_f32_vector_t y_v = { 0 };
+	ann_f32_vector_t x_v, w_v;
+	ann_h16_vector_t h_v;
+	ann_h32_vector_t u_v;
 
-    for( uint_t l = 1; l < ann->layer_n; l++ )
-    {
-		for( uint_t j = 0; j < ann->layer_neuron_n[l]; j++ )
-		{
-			for( uint_t i = 0; i < ann->layer_neuron_n[l - 1] + 1; i++ )
-			{
-                // Store original weight
-                original = *wb;
+	for( ; i + ANN_HALF_LANE_N <= n; i += ANN_HALF_LANE_N )
+	{
+		memcpy( &x_v, x + i, sizeof( ann_f32_vector_t ) );
+		memcpy( &h_v, w + i, sizeof( ann_h16_vector_t ) );
 
-                *wb = original + EPSILON;
-                ann_propagation_forward( ann, input, upper );
+		u_v = __builtin_convertvector( h_v, ann_h32_vector_t ) << 16;
+		memcpy( &w_v, &u_v, sizeof( ann_f32_vector_t ) );
 
-                *wb = original - EPSILON;
-                ann_propagation_forward( ann, input, lower );
+		y_v += x_v * w_v;
+	}
 
-                *wb = original;
+	for( uint_t k = 0; k < ANN_HALF_LANE_N; k++ )
+	{
+		y += y_v[k];
+	}
+#endif
 
-                gradient = ann_error_total( upper, target, output_n ) - ann_error_total( lower, target, output_n );
-                gradient /= ( 2 * EPSILON );
-                
-                *wbn++ = *wb++ + -rate * gradient;
-			}
-		}
-    }
+	for( ; i < n; i++ )
+	{
+		y += x[i] * ann_half_to_float( w[i], BF16 );
+	}
 
-    memcpy( ann->weight, weight_numerical, sizeof( fp_t ) * ann->weight_n );
-    free( weight_numerical );
+	return y;
 }
 
 
-////////////////////////////////////////////////////////////////////////////////
-// ACTIVATION
-////////////////////////////////////////////////////////////////////////////////
-
+// ann_dot_fp16() on the F16C conversion instruction. target_clones can't
+// select F16C, so it is built for AVX2, FMA and F16C and chosen at run time by
+// ann_f16c(). The lanes are summed in the same order as ann_dot_fp16().
 
-static fp_t ann_activation_identity( fp_t x )
-{
-	return x;
-}
+#if defined( ANN_VECTOR ) && defined( __x86_64__ ) && defined( __ELF__ )
+#include <immintrin.h>
 
+#define ANN_F16C
 
-static fp_t ann_activation_identity_partial( fp_t x )
+__attribute__(( target( "avx2,fma,f16c" ) ))
+static float ann_dot_fp16_f16c( float const *x, uint16_t const *w, uint_t n )
 {
-	return 1;
-}
+	__m256 y_0 = _mm256_setzero_ps(), y_1 = _mm256_setzero_ps();
+	float y_k[ANN_HALF_LANE_N];
+	float y = 0;
+	uint_t i = 0;
 
+	for( ; i + ANN_HALF_LANE_N <= n; i += ANN_HALF_LANE_N )
+	{
+		y_0 = _mm256_fmadd_ps( _mm256_loadu_ps( x + i ), _mm256_cvtph_ps( _mm_loadu_si128( ( __m128i const * ) ( w + i ) ) ), y_0 );
+		y_1 = _mm256_fmadd_ps( _mm256_loadu_ps( x + i + 8 ), _mm256_cvtph_ps( _mm_loadu_si128( ( __m128i const * ) ( w + i + 8 ) ) ), y_1 );
+	}
 
-static fp_t ann_activation_binary( fp_t x )
-{
-	return ( x > 0.0 ) ? 1.0 : 0.0;
-}
+	_mm256_storeu_ps( y_k, y_0 );
+	_mm256_storeu_ps( y_k + 8, y_1 );
 
+	for( uint_t k = 0; k < ANN_HALF_LANE_N; k++ )
+	{
+		y += y_k[k];
+	}
 
-static fp_t ann_activation_binary_partial( fp_t x )
-{
-	return 0.0;
-}
+	for( ; i < n; i++ )
+	{
+		y += x[i] * ann_half_to_float( w[i], FP16 );
+	}
 
-static fp_t ann_activation_sigmoid( fp_t x )
-{
-	return 1.0 / ( 1.0 + exp( -x ) );
+	return y;
 }
 
 
-static fp_t ann_activation_sigmoid_partial( fp_t x )
+static int ann_f16c( void )
 {
-	return x * ( 1.0 - x );
+	return __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) && __builtin_cpu_supports( "f16c" );
 }
+#endif
 
 
-static fp_t ann_activation_relu( fp_t x )
-{
-	return ( x > 0.0 ) ? x : 0.0;
-}
+////////////////////////////////////////////////////////////////////////////////
+// MEMORY
+////////////////////////////////////////////////////////////////////////////////
 
 
-static fp_t ann_activation_relu_partial( fp_t x )
-{
-	return ( x > 0.0 ) ? 1.0 : 0.0;
-}
+// Allocations are aligned to, and arrays within them start on, 64 byte lines
+// so that vector loads never split a line. Blocks are released with free().
+//
+// The alignment comes from posix_memalign() or C11 aligned_alloc(). Under a
+// strict C99 build neither is declared and ann_malloc() falls back to malloc(),
+// which only guarantees the alignment of the largest scalar type, usually 16
+// bytes. Everything still works, the kernels never assume alignment, but loads
+// may split lines. Define _POSIX_C_SOURCE as 200112L or later to keep it.
 
+#define ANN_ALIGN 64
 
-static fp_t ann_activation_elu( fp_t x )
+static uint_t ann_align( uint_t n )
 {
-	return ( x > 0.0 ) ? x : ELU_ALPHA * ( expm1( x ) );
+	return ( n + ANN_ALIGN - 1 ) / ANN_ALIGN * ANN_ALIGN;
 }
 
 
-static fp_t ann_activation_elu_partial( fp_t x )
+static void * ann_malloc( uint_t n )
 {
-	return ( x > 0.0 ) ? 1.0 : x + ELU_ALPHA;
+#if defined( _POSIX_C_SOURCE ) && _POSIX_C_SOURCE >= 200112L
+	void *p;
+
+	return ( posix_memalign( &p, ANN_ALIGN, n ) == 0 ) ? p : NULL;
+#elif defined( __STDC_VERSION__ ) && __STDC_VERSION__ >= 201112L
+	return aligned_alloc( ANN_ALIGN, ann_align( n ) );
+#else
+	return malloc( n );
+#endif
 }
 
 
-static fp_t ann_activation_lrelu( fp_t x )
-{
-	return ( x > 0.0 ) ? x : LRELU_ALPHA * x;
-}
+////////////////////////////////////////////////////////////////////////////////
+// TIME
+////////////////////////////////////////////////////////////////////////////////
 
 
-static fp_t ann_activation_lrelu_partial( fp_t x )
+// Seconds from an arbitrary start, on CLOCK_MONOTONIC where POSIX declares it,
+// which it always does under ANN_THREAD. Strict C11 falls back to the wall
+// clock of timespec_get(), which may step. Strict C99 has only clock(), which
+// counts processor time instead. There, ann_benchmark() reports CPU time per
+// sample, and time spent waiting or in other threads is not counted.
+
+static double ann_time( void )
 {
-    return ( x > 0.0 ) ? 1.0 : LRELU_ALPHA;
-}
+#if defined( CLOCK_MONOTONIC )
+	struct timespec t;
 
+	clock_gettime( CLOCK_MONOTONIC, &t );
 
-static fp_t ann_activation_tanh( fp_t x )
-{
-    return tanh( x );
+	return t.tv_sec + t.tv_nsec * 1e-9;
+#elif defined( TIME_UTC )
+	struct timespec t;
+
+	timespec_get( &t, TIME_UTC );
+
+	return t.tv_sec + t.tv_nsec * 1e-9;
+#else
+	return ( double ) clock() / CLOCKS_PER_SEC;
+#endif
 }
 
 
-static fp_t ann_activation_tanh_partial( fp_t x )
+static int ann_time_compare( void const *a, void const *b )
 {
-	return 1.0 - ( x * x );
+	double x = *( double const * ) a;
+	double y = *( double const * ) b;
+
+	return ( x > y ) - ( x < y );
 }
 
+
 ////////////////////////////////////////////////////////////////////////////////
-// ERROR
+// RANDOM
 ////////////////////////////////////////////////////////////////////////////////
 
 
-// Mean Squared Error
-//
-// MSE = 0.5 * ( x - y )^2
-// ( y - x )
+// x = x + 0x9E3779B97F4A7C15, then mixed, used to expand a seed into state
 
-fp_t ann_error( fp_t o, fp_t t )
+static uint64_t ann_rng_splitmix( uint64_t *x )
 {
-	fp_t e = o - t;
-	e = 0.5 * e * e;
+	uint64_t z = ( *x += 0x9E3779B97F4A7C15ULL );
+
+	z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+	z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBULL;
+
+	return z ^ ( z >> 31 );
+}
+
+
+// Seeds the lanes of rng from seed and stream. The same pair always gives the
+// same sequence, different streams of one seed being independent, so threads
+// can share a seed and use their index as the stream.
+
+void ann_rng_init( ann_rng_t *rng, uint64_t seed, uint64_t stream )
+{
+	uint64_t x = seed;
+
+	x ^= ann_rng_splitmix( &stream );
+
+	for( uint_t i = 0; i < 4; i++ )
+	{
+		for( uint_t k = 0; k < ANN_RNG_LANE_N; k++ )
+		{
+			rng->s[i][k] = ann_rng_splitmix( &x );
+		}
+	}
+
+	rng->buffer_i = ANN_RNG_LANE_N;
+}
+
+
+// Steps every lane once, writing one output per lane to y
+//
+// y = s_0 + s_3
+// s_2 ^= s_0, s_3 ^= s_1, s_1 ^= s_2, s_0 ^= s_3, s_2 ^= t, s_3 = rotl( s_3, 45 )
+// t being the old s_1 << 17
+
+#ifdef ANN_VECTOR
+typedef uint64_t ann_rng_vector_t __attribute__(( vector_size( 8 * ANN_RNG_LANE_N ) ));
+#endif
+
+ANN_SIMD static void ann_rng_block( ann_rng_t *rng, uint64_t *y )
+{
+#ifdef ANN_VECTOR
+	ann_rng_vector_t s_0, s_1, s_2, s_3, t;
+
+	memcpy( &s_0, rng->s[0], sizeof( ann_rng_vector_t ) );
+	memcpy( &s_1, rng->s[1], sizeof( ann_rng_vector_t ) );
+	memcpy( &s_2, rng->s[2], sizeof( ann_rng_vector_t ) );
+	memcpy( &s_3, rng->s[3], sizeof( ann_rng_vector_t ) );
+
+	t = s_0 + s_3;
+	memcpy( y, &t, sizeof( ann_rng_vector_t ) );
+
+	t = s_1 << 17;
+	s_2 ^= s_0;
+	s_3 ^= s_1;
+	s_1 ^= s_2;
+	s_0 ^= s_3;
+	s_2 ^= t;
+	s_3 = ( s_3 << 45 ) | ( s_3 >> 19 );
+
+	memcpy( rng->s[0], &s_0, sizeof( ann_rng_vector_t ) );
+	memcpy( rng->s[1], &s_1, sizeof( ann_rng_vector_t ) );
+	memcpy( rng->s[2], &s_2, sizeof( ann_rng_vector_t ) );
+	memcpy( rng->s[3], &s_3, sizeof( ann_rng_vector_t ) );
+#else
+	for( uint_t k = 0; k < ANN_RNG_LANE_N; k++ )
+	{
+		uint64_t t = rng->s[1][k] << 17;
+
+		y[k] = rng->s[0][k] + rng->s[3][k];
+
+		rng->s[2][k] ^= rng->s[0][k];
+		rng->s[3][k] ^= rng->s[1][k];
+		rng->s[1][k] ^= rng->s[2][k];
+		rng->s[0][k] ^= rng->s[3][k];
+		rng->s[2][k] ^= t;
+		rng->s[3][k] = ( rng->s[3][k] << 45 ) | ( rng->s[3][k] >> 19 );
+	}
+#endif
+}
+
+
+// The next single output of rng
+
+uint64_t ann_rng_next( ann_rng_t *rng )
+{
+	if( rng->buffer_i == ANN_RNG_LANE_N )
+	{
+		ann_rng_block( rng, rng->buffer );
+		rng->buffer_i = 0;
+	}
+
+	return rng->buffer[rng->buffer_i++];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// THREAD
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef ANN_THREAD
+
+
+#include <pthread.h>
+
+
+// The fewest multiply-adds for which a layer is split across a pool, below it
+// waking the threads costs more than it saves
+
+#ifndef ANN_POOL_LAYER_MIN
+#define ANN_POOL_LAYER_MIN ( 1 << 18 )
+#endif
+
+
+typedef struct
+{
+	ann_pool_t *pool;
+	uint_t i;
+} ann_pool_worker_t;
+
+
+struct ann_pool_t
+{
+	// The number of threads, including the one calling ann_pool_run()
+	uint_t thread_n;
+
+	pthread_t *thread;
+	ann_pool_worker_t *worker;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t start;
+	pthread_cond_t done;
+
+	// Incremented by every ann_pool_run(), the threads wait for it to change
+	uint_t generation;
+
+	// The number of threads still running the current task
+	uint_t busy;
+	int stop;
+
+	void ( *task )( void *, uint_t, uint_t );
+	void *argument;
+};
+
+
+static void * ann_pool_thread( void * );
+
+
+// Starts thread_n - 1 threads, the caller of ann_pool_run() being the last one
+
+ann_pool_t * ann_pool_init( uint_t thread_n )
+{
+	assert( thread_n >= 1 );
+
+	ann_pool_t *pool = malloc( sizeof( ann_pool_t ) );
+
+	pool->thread_n = thread_n;
+	pool->thread = malloc( sizeof( pthread_t ) * thread_n );
+	pool->worker = malloc( sizeof( ann_pool_worker_t ) * thread_n );
+	pool->generation = 0;
+	pool->busy = 0;
+	pool->stop = 0;
+
+	pthread_mutex_init( &pool->mutex, NULL );
+	pthread_cond_init( &pool->start, NULL );
+	pthread_cond_init( &pool->done, NULL );
+
+	for( uint_t i = 1; i < thread_n; i++ )
+	{
+		pool->worker[i].pool = pool;
+		pool->worker[i].i = i;
+		pthread_create( &pool->thread[i], NULL, ann_pool_thread, &pool->worker[i] );
+	}
+
+	return pool;
+}
+
+
+void ann_pool_free( ann_pool_t *pool )
+{
+	pthread_mutex_lock( &pool->mutex );
+	pool->stop = 1;
+	pthread_cond_broadcast( &pool->start );
+	pthread_mutex_unlock( &pool->mutex );
+
+	for( uint_t i = 1; i < pool->thread_n; i++ )
+	{
+		pthread_join( pool->thread[i], NULL );
+	}
+
+	pthread_cond_destroy( &pool->done );
+	pthread_cond_destroy( &pool->start );
+	pthread_mutex_destroy( &pool->mutex );
+
+	free( pool->worker );
+	free( pool->thread );
+	free( pool );
+}
+
+
+uint_t ann_pool_thread_n( ann_pool_t const *pool )
+{
+	return pool->thread_n;
+}
+
+
+// Runs task( argument, i, thread_n ) once on every thread, i being the index of
+// the thread, and returns once all of them are done. The calling thread runs
+// i = 0.
+
+void ann_pool_run( ann_pool_t *pool, void ( *task )( void *, uint_t, uint_t ), void *argument )
+{
+	pthread_mutex_lock( &pool->mutex );
+	pool->task = task;
+	pool->argument = argument;
+	pool->busy = pool->thread_n - 1;
+	pool->generation++;
+	pthread_cond_broadcast( &pool->start );
+	pthread_mutex_unlock( &pool->mutex );
+
+	task( argument, 0, pool->thread_n );
+
+	pthread_mutex_lock( &pool->mutex );
+
+	while( pool->busy > 0 )
+	{
+		pthread_cond_wait( &pool->done, &pool->mutex );
+	}
+
+	pthread_mutex_unlock( &pool->mutex );
+}
+
+
+static void * ann_pool_thread( void *argument )
+{
+	ann_pool_worker_t *worker = argument;
+	ann_pool_t *pool = worker->pool;
+	uint_t generation = 0;
+
+	pthread_mutex_lock( &pool->mutex );
+
+	for( ;; )
+	{
+		while( pool->generation == generation && !pool->stop )
+		{
+			pthread_cond_wait( &pool->start, &pool->mutex );
+		}
+
+		if( pool->stop )
+		{
+			break;
+		}
+
+		generation = pool->generation;
+		pthread_mutex_unlock( &pool->mutex );
+
+		pool->task( pool->argument, worker->i, pool->thread_n );
+
+		pthread_mutex_lock( &pool->mutex );
+
+		if( --pool->busy == 0 )
+		{
+			pthread_cond_signal( &pool->done );
+		}
+	}
+
+	pthread_mutex_unlock( &pool->mutex );
+
+	return NULL;
+}
+
+
+#endif // ANN_THREAD
+
+
+#define ANN_TEMPLATE
+#define ANN_TEMPLATE_IMPLEMENTATION
+
+#define ANN_FP double
+#define ANN_NAME( name ) ann_ ## name
+#include "ann.h"
+#undef ANN_FP
+#undef ANN_NAME
+
+#define ANN_FP float
+#define ANN_NAME( name ) annf_ ## name
+#include "ann.h"
+#undef ANN_FP
+#undef ANN_NAME
+
+#undef ANN_TEMPLATE_IMPLEMENTATION
+#undef ANN_TEMPLATE
+
+
+////////////////////////////////////////////////////////////////////////////////
+// CONVERSION
+////////////////////////////////////////////////////////////////////////////////
+
+
+// Converts a double precision network into a new single precision network with
+// the same topology, weights and activations
+
+annf_t * ann_to_annf( ann_t const *ann )
+{
+	annf_t *annf = annf_init( ann->layer_n, ann_layer_neuron_n( ann ) );
+	fp_t const *w = ann_weight( ann );
+	fpf_t *w_f = annf_weight( annf );
+
+	// The rows are padded differently at each precision
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		uint_t x_n = ann_layer_neuron_n( ann )[l - 1];
+
+		for( uint_t j = 0; j < ann_layer_neuron_n( ann )[l]; j++ )
+		{
+			for( uint_t i = 0; i < x_n + 1; i++ )
+			{
+				w_f[i] = ( fpf_t ) w[i];
+			}
+
+			w += ann_stride( x_n );
+			w_f += annf_stride( x_n );
+		}
+	}
+
+	annf_set_activation( annf, ann->activation_hidden_type, ann->activation_output_type );
+
+	return annf;
+}
+
+
+// Converts a single precision network into a new double precision network
+
+ann_t * annf_to_ann( annf_t const *annf )
+{
+	ann_t *ann = ann_init( annf->layer_n, annf_layer_neuron_n( annf ) );
+	fpf_t const *w_f = annf_weight( annf );
+	fp_t *w = ann_weight( ann );
+
+	for( uint_t l = 1; l < annf->layer_n; l++ )
+	{
+		uint_t x_n = annf_layer_neuron_n( annf )[l - 1];
+
+		for( uint_t j = 0; j < annf_layer_neuron_n( annf )[l]; j++ )
+		{
+			for( uint_t i = 0; i < x_n + 1; i++ )
+			{
+				w[i] = ( fp_t ) w_f[i];
+			}
+
+			w_f += annf_stride( x_n );
+			w += ann_stride( x_n );
+		}
+	}
+
+	ann_set_activation( ann, annf->activation_hidden_type, annf->activation_output_type );
+
+	return ann;
+}
+
+
+#endif // ANN_IMPLEMENTATION
+
+
+#else // ANN_TEMPLATE
+
+
+// Every type dependent name is mapped through ANN_NAME() for the duration of
+// the template, ann_init becomes ann_init or annf_init and so on
+
+#define fp_t                             ANN_FP
+#define ann_t                            ANN_NAME( t )
+#define ann_vector_t                     ANN_NAME( vector_t )
+
+#define ann_init                         ANN_NAME( init )
+#define ann_copy                         ANN_NAME( copy )
+#define ann_free                         ANN_NAME( free )
+#define ann_random                       ANN_NAME( random )
+#define ann_random_init                   ANN_NAME( random_init )
+#define ann_random_uniform                ANN_NAME( random_uniform )
+#define ann_random_normal                 ANN_NAME( random_normal )
+#define ann_layer_neuron_n                ANN_NAME( layer_neuron_n )
+#define ann_weight                        ANN_NAME( weight )
+#define ann_neuron                        ANN_NAME( neuron )
+#define ann_delta                         ANN_NAME( delta )
+#define ann_gradient                      ANN_NAME( gradient )
+#define ann_moment                        ANN_NAME( moment )
+#define ann_variance                      ANN_NAME( variance )
+#define ann_stride                        ANN_NAME( stride )
+#define ann_save                          ANN_NAME( save )
+#define ann_load                          ANN_NAME( load )
+#define ann_map                           ANN_NAME( map )
+#define ann_unmap                         ANN_NAME( unmap )
+#define ann_export                        ANN_NAME( export )
+#define ann_export_text                   ANN_NAME( export_text )
+#define ann_export_activation             ANN_NAME( export_activation )
+#define ann_export_layer                  ANN_NAME( export_layer )
+#define ann_model_size                    ANN_NAME( model_size )
+#define ann_layout                        ANN_NAME( layout )
+#define ann_optimizer_clear               ANN_NAME( optimizer_clear )
+#define ann_model_valid                   ANN_NAME( model_valid )
+#define ann_propagation_forward          ANN_NAME( propagation_forward )
+#define ann_propagation_forward_batch    ANN_NAME( propagation_forward_batch )
+#define ann_propagation_backward         ANN_NAME( propagation_backward )
+#define ann_train_numeric                ANN_NAME( train_numeric )
+#define ann_error_total                  ANN_NAME( error_total )
+#define ann_error_cross_entropy           ANN_NAME( error_cross_entropy )
+#define ann_set_activation               ANN_NAME( set_activation )
+#define ann_set_optimizer                 ANN_NAME( set_optimizer )
+#define ann_print_weight                 ANN_NAME( print_weight )
+#define ann_print_neuron                 ANN_NAME( print_neuron )
+#define ann_workspace_t                  ANN_NAME( workspace_t )
+#define ann_workspace_init               ANN_NAME( workspace_init )
+#define ann_workspace_free               ANN_NAME( workspace_free )
+#define ann_workspace_forward            ANN_NAME( workspace_forward )
+#define ann_workspace_backward           ANN_NAME( workspace_backward )
+#define ann_checker_t                     ANN_NAME( checker_t )
+#define ann_checker_init                  ANN_NAME( checker_init )
+#define ann_checker_free                  ANN_NAME( checker_free )
+#define ann_checker_gradient              ANN_NAME( checker_gradient )
+#define ann_checker_gradient_pool         ANN_NAME( checker_gradient_pool )
+#define ann_checker_forward               ANN_NAME( checker_forward )
+#define ann_checker_range                 ANN_NAME( checker_range )
+#define ann_checker_difference            ANN_NAME( checker_difference )
+#define ann_checker_task                  ANN_NAME( checker_task )
+#define ann_error                        ANN_NAME( error )
+#define ann_error_partial                ANN_NAME( error_partial )
+#define ann_activation_binary            ANN_NAME( activation_binary )
+#define ann_activation_binary_partial    ANN_NAME( activation_binary_partial )
+#define ann_activation_sigmoid           ANN_NAME( activation_sigmoid )
+#define ann_activation_sigmoid_partial   ANN_NAME( activation_sigmoid_partial )
+#define ann_activation_relu              ANN_NAME( activation_relu )
+#define ann_activation_relu_partial      ANN_NAME( activation_relu_partial )
+#define ann_activation_elu               ANN_NAME( activation_elu )
+#define ann_activation_elu_partial       ANN_NAME( activation_elu_partial )
+#define ann_activation_lrelu             ANN_NAME( activation_lrelu )
+#define ann_activation_lrelu_partial     ANN_NAME( activation_lrelu_partial )
+#define ann_activation_tanh              ANN_NAME( activation_tanh )
+#define ann_activation_tanh_partial      ANN_NAME( activation_tanh_partial )
+#define ann_activation_sigmoid_fast       ANN_NAME( activation_sigmoid_fast )
+#define ann_activation_elu_fast           ANN_NAME( activation_elu_fast )
+#define ann_activation_tanh_fast          ANN_NAME( activation_tanh_fast )
+#define ann_activation_forward            ANN_NAME( activation_forward )
+#define ann_activation_backward           ANN_NAME( activation_backward )
+#define ann_dot                          ANN_NAME( dot )
+#define ann_axpy                         ANN_NAME( axpy )
+#define ann_dot4                         ANN_NAME( dot4 )
+#define ann_dot4x2                       ANN_NAME( dot4x2 )
+#define ann_axpy4                        ANN_NAME( axpy4 )
+#define ann_ger4                         ANN_NAME( ger4 )
+#define ann_axpy4_ger4                    ANN_NAME( axpy4_ger4 )
+#define ann_update                        ANN_NAME( update )
+#define ann_update_sgd                    ANN_NAME( update_sgd )
+#define ann_update_momentum               ANN_NAME( update_momentum )
+#define ann_update_adam                   ANN_NAME( update_adam )
+#define ann_softmax                       ANN_NAME( softmax )
+#define ann_mask_t                        ANN_NAME( mask_t )
+#define ann_layer_forward                ANN_NAME( layer_forward )
+#define ann_layer_accumulate             ANN_NAME( layer_accumulate )
+#define ann_quant_t                       ANN_NAME( quant_t )
+#define ann_quant_init                    ANN_NAME( quant_init )
+#define ann_quant_free                    ANN_NAME( quant_free )
+#define ann_quant_propagation_forward     ANN_NAME( quant_propagation_forward )
+#define ann_quant_error                   ANN_NAME( quant_error )
+#define ann_sparse_t                      ANN_NAME( sparse_t )
+#define ann_sparse_init                   ANN_NAME( sparse_init )
+#define ann_sparse_free                   ANN_NAME( sparse_free )
+#define ann_sparse_propagation_forward    ANN_NAME( sparse_propagation_forward )
+#define ann_sparse_error                  ANN_NAME( sparse_error )
+#define ann_half_t                        ANN_NAME( half_t )
+#define ann_half_init                     ANN_NAME( half_init )
+#define ann_half_free                     ANN_NAME( half_free )
+#define ann_half_propagation_forward      ANN_NAME( half_propagation_forward )
+#define ann_half_error                    ANN_NAME( half_error )
+#define ann_half_stride                   ANN_NAME( half_stride )
+#define ann_sparse_threshold              ANN_NAME( sparse_threshold )
+#define ann_sparse_compare                ANN_NAME( sparse_compare )
+#define ann_dot_sparse                    ANN_NAME( dot_sparse )
+#define ann_benchmark                     ANN_NAME( benchmark )
+#define ann_benchmark_batch               ANN_NAME( benchmark_batch )
+#define ann_train_batch                   ANN_NAME( train_batch )
+#define ann_gradient_accumulate           ANN_NAME( gradient_accumulate )
+#define ann_gradient_apply                ANN_NAME( gradient_apply )
+#define ann_propagation_delta             ANN_NAME( propagation_delta )
+#define ann_propagation_delta_output      ANN_NAME( propagation_delta_output )
+#define ann_propagation_accumulate        ANN_NAME( propagation_accumulate )
+#define ann_propagation_fused             ANN_NAME( propagation_fused )
+#define ann_trainer_t                     ANN_NAME( trainer_t )
+#define ann_trainer_init                  ANN_NAME( trainer_init )
+#define ann_trainer_free                  ANN_NAME( trainer_free )
+#define ann_trainer_batch                 ANN_NAME( trainer_batch )
+#define ann_trainer_accumulate            ANN_NAME( trainer_accumulate )
+#define ann_propagation_forward_pool      ANN_NAME( propagation_forward_pool )
+#define ann_workspace_forward_pool        ANN_NAME( workspace_forward_pool )
+#define ann_layer_task_t                  ANN_NAME( layer_task_t )
+#define ann_layer_task                    ANN_NAME( layer_task )
+#define ann_loader_t                      ANN_NAME( loader_t )
+#define ann_loader_init                   ANN_NAME( loader_init )
+#define ann_loader_free                   ANN_NAME( loader_free )
+#define ann_loader_next                   ANN_NAME( loader_next )
+#define ann_loader_read                   ANN_NAME( loader_read )
+#define ann_loader_thread                 ANN_NAME( loader_thread )
+#define ann_queue_request_t               ANN_NAME( queue_request_t )
+#define ann_queue_t                       ANN_NAME( queue_t )
+#define ann_queue_init                    ANN_NAME( queue_init )
+#define ann_queue_free                    ANN_NAME( queue_free )
+#define ann_queue_submit                  ANN_NAME( queue_submit )
+#define ann_queue_wait                    ANN_NAME( queue_wait )
+#define ann_queue_forward                 ANN_NAME( queue_forward )
+#define ann_queue_stats                   ANN_NAME( queue_stats )
+#define ann_queue_thread                  ANN_NAME( queue_thread )
+#define ann_trainer_reduce                ANN_NAME( trainer_reduce )
+
+
+#ifndef ANN_TEMPLATE_IMPLEMENTATION
+
+
+// The arrays of a network follow the structure in the same allocation and are
+// found by their byte offset from its start, never by address, so the block can
+// be copied with memcpy(), written to a file and mapped back at any address.
+// They are reached through ann_layer_neuron_n(), ann_weight() and so on. Each
+// one starts on a 64 byte line and weight rows are padded, see ann_stride().
+//
+// ann_t | layer_neuron_n[] | weight[] | neuron[] | delta[] | gradient[] |
+//     moment[] | variance[]
+//
+// The model is everything up to the end of weight[], the rest is scratch
+// space for propagation and training. ann_save() only writes the model.
+
+typedef struct
+{
+	// ANN_MAGIC and ANN_VERSION
+	uint_t magic;
+	uint_t version;
+
+	// The full size of the allocated structure
+	uint_t n;
+
+	// The size of fp_t, so a saved network is only mapped at its own precision
+	uint_t fp_n;
+
+	// The number of layers in the neural network
+	uint_t layer_n;
+
+	// The neuron count ( hidden )
+	uint_t neuron_n;
+
+	// The total number of weights and biases, including the row padding
+	uint_t weight_n;
+
+	// The number of neurons in each layer
+	uint_t layer_neuron_n_offset;
+
+	// The weights and biases for each neuron
+	//   - w_lji denotes the connection between the jth neuron in layer l, and
+	//     the ith connection in the previous layer
+	//   - b_lj denotes the bias for the jth neuron in layer l
+	// { w_000, w_001, w_002, .... , b_00, 0, ...., w_ijk, b_ij, 0, ... }
+	uint_t weight_offset;
+
+	// The hidden neurons
+	uint_t neuron_offset;
+
+	// The delta between between the actual and the cost function
+	uint_t delta_offset;
+
+	// The gradient of the error with respect to each weight and bias, summed
+	// over the samples passed to ann_gradient_accumulate()
+	uint_t gradient_offset;
+
+	// The optimizer state for each weight and bias, allocated for every
+	// network but only touched by the optimizers that use it
+	//   - moment is the velocity for MOMENTUM and the first moment for ADAM
+	//   - variance is the second moment for ADAM
+	uint_t moment_offset;
+	uint_t variance_offset;
+
+	// The activation types selected with ann_set_activation(), propagation
+	// runs the specialized layer kernel for each
+	ann_activation_t activation_hidden_type;
+	ann_activation_t activation_output_type;
+
+	// The optimizer selected with ann_set_optimizer() and its parameters, which
+	// may be changed between updates
+	//   - MOMENTUM: v = beta_1 * v + g, w = w - rate * v
+	//   - ADAM: beta_1 and beta_2 are the decay of the two moments, epsilon
+	//     keeps the step finite where the second moment is zero
+	ann_optimizer_t optimizer;
+	fp_t beta_1;
+	fp_t beta_2;
+	fp_t epsilon;
+
+	// The number of updates applied since ann_set_optimizer(), for the bias
+	// correction of ADAM
+	uint_t step_n;
+} ann_t;
+
+
+static inline uint_t * ann_layer_neuron_n( ann_t const *ann )
+{
+	return ( uint_t * ) ( ( uint8_t * ) ann + ann->layer_neuron_n_offset );
+}
+
+static inline fp_t * ann_weight( ann_t const *ann )
+{
+	return ( fp_t * ) ( ( uint8_t * ) ann + ann->weight_offset );
+}
+
+static inline fp_t * ann_neuron( ann_t const *ann )
+{
+	return ( fp_t * ) ( ( uint8_t * ) ann + ann->neuron_offset );
+}
+
+static inline fp_t * ann_delta( ann_t const *ann )
+{
+	return ( fp_t * ) ( ( uint8_t * ) ann + ann->delta_offset );
+}
+
+static inline fp_t * ann_gradient( ann_t const *ann )
+{
+	return ( fp_t * ) ( ( uint8_t * ) ann + ann->gradient_offset );
+}
+
+static inline fp_t * ann_moment( ann_t const *ann )
+{
+	return ( fp_t * ) ( ( uint8_t * ) ann + ann->moment_offset );
+}
+
+static inline fp_t * ann_variance( ann_t const *ann )
+{
+	return ( fp_t * ) ( ( uint8_t * ) ann + ann->variance_offset );
+}
+
+
+// The distance in fp_t from one weight row to the next, for a layer with x_n
+// inputs. A row holds the x_n weights and the bias, padded with zeros to whole
+// 64 byte lines so that every row starts on a line.
+
+static inline uint_t ann_stride( uint_t x_n )
+{
+	uint_t line_n = 64 / sizeof( fp_t );
+
+	return ( x_n + 1 + line_n - 1 ) / line_n * line_n;
+}
+
+
+ann_t * ann_init( uint_t, uint_t * );
+ann_t * ann_copy( ann_t const * );
+void ann_free( ann_t * );
+void ann_random( ann_t * );
+void ann_random_init( ann_t *, ann_initializer_t, ann_rng_t * );
+void ann_random_uniform( ann_rng_t *, fp_t *, uint_t, fp_t, fp_t );
+void ann_random_normal( ann_rng_t *, fp_t *, uint_t, fp_t, fp_t );
+
+int ann_save( ann_t const *, char const * );
+ann_t * ann_load( char const * );
+ann_t const * ann_map( char const * );
+void ann_unmap( ann_t const * );
+int ann_export( ann_t const *, char const *, char const * );
+
+void ann_propagation_forward( ann_t *, fp_t const * const, fp_t * );
+void ann_propagation_forward_batch( ann_t const *, fp_t const *, uint_t, fp_t * );
+void ann_propagation_backward( ann_t *, fp_t const *, fp_t *, fp_t const *, fp_t );
+void ann_train_batch( ann_t *, fp_t const *, fp_t const *, uint_t, fp_t );
+
+void ann_gradient_accumulate( ann_t *, fp_t const *, fp_t const *, fp_t const * );
+void ann_gradient_apply( ann_t *, fp_t );
+
+fp_t ann_error_total( fp_t const *, fp_t const *, uint_t );
+fp_t ann_error_cross_entropy( fp_t const *, fp_t const *, uint_t );
+void ann_set_activation( ann_t *, ann_activation_t, ann_activation_t );
+void ann_set_optimizer( ann_t *, ann_optimizer_t );
+
+void ann_print_weight( ann_t * );
+void ann_print_neuron( ann_t *, fp_t const * const, fp_t const * const );
+
+
+// Caller owned neurons and deltas, so one read-only ann_t can be propagated by
+// any number of threads at once, each with its own workspace
+
+typedef struct
+{
+	// The full size of the allocated structure
+	uint_t n;
+
+	// The neuron count ( hidden ), as in the ann_t it was made for
+	uint_t neuron_n;
+
+	// The hidden neurons of the last forward pass
+	fp_t *neuron;
+
+	// The hidden and output deltas of the last backward pass
+	fp_t *delta;
+} ann_workspace_t;
+
+
+ann_workspace_t * ann_workspace_init( ann_t const * );
+void ann_workspace_free( ann_workspace_t * );
+
+void ann_workspace_forward( ann_t const *, ann_workspace_t *, fp_t const *, fp_t * );
+void ann_workspace_backward( ann_t const *, ann_workspace_t *, fp_t const *, fp_t const *, fp_t const *, fp_t * );
+
+
+// Int8 quantized network for inference, built from a trained ann_t
+
+typedef struct
+{
+	// The full size of the allocated structure
+	uint_t n;
+
+	// The number of layers in the neural network
+	uint_t layer_n;
+
+	// The widest layer, used to size the scratch buffers
+	uint_t width;
+
+	// The total number of weights, excluding biases
+	uint_t weight_n;
+
+	// The number of neurons in each layer
+	uint_t *layer_neuron_n;
+
+	// The scale of the quantized input to each layer, taken from calibration
+	//   - x_i ~= scale_input[l - 1] * q_i
+	fp_t *scale_input;
+
+	// The scale of each weight row and the unquantized bias of each neuron
+	//   - w_lji ~= scale_weight[lj] * q_lji
+	fp_t *scale_weight;
+	fp_t *bias;
+
+	// The quantized weights, ann_t weights with the biases removed
+	int8_t *weight;
+
+	// The activation types, as in the source ann_t
+	ann_activation_t activation_hidden_type;
+	ann_activation_t activation_output_type;
+} ann_quant_t;
+
+
+ann_quant_t * ann_quant_init( ann_t *, fp_t const *, uint_t );
+void ann_quant_free( ann_quant_t * );
+void ann_quant_propagation_forward( ann_quant_t const *, fp_t const *, fp_t * );
+fp_t ann_quant_error( ann_quant_t const *, ann_t *, fp_t const *, uint_t );
+
+
+// Magnitude pruned network for inference, built from a trained ann_t. The
+// weights kept in each layer are stored row by row in CSR form.
+
+typedef struct
+{
+	// The full size of the allocated structure
+	uint_t n;
+
+	// The number of layers in the neural network
+	uint_t layer_n;
+
+	// The widest layer, used to size the scratch buffer
+	uint_t width;
+
+	// The number of weights kept, excluding biases
+	uint_t weight_n;
+
+	// The number of neurons in each layer
+	uint_t *layer_neuron_n;
+
+	// The weights of neuron r, counting neurons across all layers, are
+	// weight[row[r]] to weight[row[r + 1] - 1], weight[k] multiplying input
+	// column[k] of its layer
+	uint_t *row;
+	uint_t *column;
+	fp_t *weight;
+
+	// The bias of each neuron, never pruned
+	fp_t *bias;
+
+	// The activation types, as in the source ann_t
+	ann_activation_t activation_hidden_type;
+	ann_activation_t activation_output_type;
+} ann_sparse_t;
+
+
+ann_sparse_t * ann_sparse_init( ann_t const *, fp_t );
+void ann_sparse_free( ann_sparse_t * );
+void ann_sparse_propagation_forward( ann_sparse_t const *, fp_t const *, fp_t * );
+fp_t ann_sparse_error( ann_sparse_t const *, ann_t *, fp_t const *, uint_t );
+
+
+// Network for inference with FP16 or BF16 weights, built from a trained ann_t.
+// The weights are widened to float in the kernels, which compute in float.
+
+typedef struct
+{
+	// The full size of the allocated structure
+	uint_t n;
+
+	// The number of layers in the neural network
+	uint_t layer_n;
+
+	// The widest layer, used to size the scratch buffers
+	uint_t width;
+
+	// The number of weights stored, including the row padding
+	uint_t weight_n;
+
+	// The number of neurons in each layer
+	uint_t *layer_neuron_n;
+
+	// The weights in format, ann_t weights with the biases removed and each row
+	// padded to whole 64 byte lines
+	ann_half_format_t format;
+	uint16_t *weight;
+
+	// The bias of each neuron, kept at full precision
+	fp_t *bias;
+
+	// The activation types, as in the source ann_t
+	ann_activation_t activation_hidden_type;
+	ann_activation_t activation_output_type;
+} ann_half_t;
+
+
+ann_half_t * ann_half_init( ann_t const *, ann_half_format_t );
+void ann_half_free( ann_half_t * );
+void ann_half_propagation_forward( ann_half_t const *, fp_t const *, fp_t * );
+fp_t ann_half_error( ann_half_t const *, ann_t *, fp_t const *, uint_t );
+
+void ann_benchmark( ann_t const *, ann_benchmark_mode_t, uint_t, uint_t, ann_benchmark_t * );
+
+
+// Numeric gradient by central differences, for checking ann_workspace_backward()
+//
+// The activations of every layer are cached for the sample, so a perturbed
+// weight only recomputes the layers after its own. Everything is allocated by
+// ann_checker_init() and reused across calls.
+
+typedef struct
+{
+	// The full size of the allocated structure
+	uint_t n;
+
+	// The network being checked
+	ann_t const *ann;
+
+	// The number of threads the weights can be split across
+	uint_t thread_n;
+
+	// The widest layer after the input
+	uint_t width;
+
+	// The step, w_i +- epsilon
+	fp_t epsilon;
+
+	// The offset of each layer in z[] and a[], and of its weights in weight[]
+	uint_t *layer_offset;
+	uint_t *weight_offset;
+
+	// The pre-activations and activations of every layer after the input for
+	// the sample being checked
+	fp_t *z;
+	fp_t *a;
+
+	// Two layers and two outputs of scratch space per thread, each thread's
+	// slice being scratch_n values padded to whole lines
+	fp_t *scratch;
+	uint_t scratch_n;
+
+	// The sample being checked
+	fp_t const *input;
+	fp_t const *target;
+	fp_t *gradient;
+} ann_checker_t;
+
+
+ann_checker_t * ann_checker_init( ann_t const *, uint_t );
+void ann_checker_free( ann_checker_t * );
+void ann_checker_gradient( ann_checker_t *, fp_t const *, fp_t const *, fp_t * );
+void ann_train_numeric( ann_t *, ann_checker_t *, fp_t const *, fp_t const *, fp_t );
+
+
+#ifdef ANN_THREAD
+
+void ann_checker_gradient_pool( ann_checker_t *, ann_pool_t *, fp_t const *, fp_t const *, fp_t * );
+
+void ann_propagation_forward_pool( ann_t *, ann_pool_t *, fp_t const *, fp_t * );
+void ann_workspace_forward_pool( ann_t const *, ann_workspace_t *, ann_pool_t *, fp_t const *, fp_t * );
+
+
+// Batching queue for serving. Threads submit single inputs and wait on them, a
+// dispatcher thread runs whatever is pending as one ann_propagation_forward_batch()
+// once batch_max requests are waiting or the oldest has waited deadline seconds.
+// A larger batch_max or deadline trades latency for throughput.
+
+typedef struct ann_queue_request_t
+{
+	fp_t const *input;
+	fp_t *output;
+
+	// Set by the queue
+	double time;
+	int done;
+	struct ann_queue_request_t *next;
+} ann_queue_request_t;
+
+
+typedef struct
+{
+	// The full size of the allocated structure
+	uint_t n;
+
+	// The network served, only read
+	ann_t const *ann;
+
+	uint_t batch_max;
+	double deadline;
+
+	// The inputs and outputs of the batch being run
+	fp_t *input;
+	fp_t *output;
+
+	// The pending requests, oldest first
+	ann_queue_request_t *head;
+	ann_queue_request_t *tail;
+	uint_t pending_n;
+
+	// The latencies of the last latency_n requests, latency_i being the total
+	double *latency;
+	uint_t latency_n;
+	uint64_t latency_i;
+	uint64_t batch_n;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t submitted;
+	pthread_cond_t completed;
+	int stop;
+} ann_queue_t;
+
+
+ann_queue_t * ann_queue_init( ann_t const *, uint_t, double );
+void ann_queue_free( ann_queue_t * );
+void ann_queue_submit( ann_queue_t *, ann_queue_request_t *, fp_t const *, fp_t * );
+void ann_queue_wait( ann_queue_t *, ann_queue_request_t * );
+void ann_queue_forward( ann_queue_t *, fp_t const *, fp_t * );
+void ann_queue_stats( ann_queue_t *, ann_queue_stats_t * );
+
+
+#ifdef BIN_H
+
+// Streams training batches out of a bin.h file. A background thread reads the
+// blocks ahead into one batch while the other is being trained on, drawing
+// each sample at random from a window of the next window_n in the file.
+// Memory is fixed by batch_n and window_n, whatever the size of the file.
+//
+// Every block holds input_n inputs followed by output_n targets, as fp_t,
+// starting offset bytes into the block.
+
+typedef struct
+{
+	// The full size of the allocated structure
+	uint_t n;
+
+	// The file, its block count and block size from its bin_meta_t
+	FILE *file;
+	uint64_t length;
+	uint64_t block_size;
+	uint_t offset;
+
+	// The sample and batch sizes
+	uint_t input_n;
+	uint_t output_n;
+	uint_t batch_n;
+	uint_t window_n;
+
+	// Blocks are read chunk_n at a time, chunk_i being the next one to use
+	uint8_t *chunk;
+	uint_t chunk_n;
+	uint_t chunk_i;
+	uint_t chunk_count;
+	uint64_t read_i;
+
+	// The shuffle window, window_count samples of input_n + output_n
+	fp_t *window;
+	uint_t window_count;
+	uint64_t random;
+
+	// The two batches, input_n * batch_n inputs followed by output_n * batch_n
+	// targets each, with the number of samples in each once it is full
+	fp_t *batch[2];
+	uint_t count[2];
+	int full[2];
+
+	// The batch handed out by the last ann_loader_next(), if any
+	uint_t turn;
+	int held;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t changed;
+	int stop;
+} ann_loader_t;
+
+
+ann_loader_t * ann_loader_init( ann_t const *, char const *, uint_t, uint_t, uint_t, uint64_t );
+void ann_loader_free( ann_loader_t * );
+uint_t ann_loader_next( ann_loader_t *, fp_t const **, fp_t const ** );
+
+#endif // BIN_H
+
+// Data parallel mini-batch trainer, splitting every batch across a thread pool
+
+typedef struct
+{
+	// The network being trained
+	ann_t *ann;
+
+	// The threads the batch is split across
+	ann_pool_t *pool;
+
+	// One workspace and one gradient per thread, the weights are shared
+	ann_workspace_t **workspace;
+	fp_t *gradient;
+
+	// The batch being trained on
+	fp_t const *input;
+	fp_t const *target;
+	uint_t batch_n;
+	fp_t rate;
+} ann_trainer_t;
+
+
+ann_trainer_t * ann_trainer_init( ann_t *, ann_pool_t * );
+void ann_trainer_free( ann_trainer_t * );
+void ann_trainer_batch( ann_trainer_t *, fp_t const *, fp_t const *, uint_t, fp_t );
+
+#endif // ANN_THREAD
+
+
+#else // ANN_TEMPLATE_IMPLEMENTATION
+
+
+#ifdef ANN_VECTOR
+typedef fp_t ann_vector_t __attribute__(( vector_size( 64 ) ));
+
+// The result of comparing two vectors, lanes of all ones or all zeros
+typedef __typeof__( ( ann_vector_t ){ 0 } < ( ann_vector_t ){ 0 } ) ann_mask_t;
+#endif
+
+
+static void ann_propagation_delta( ann_t const *, ann_workspace_t *, fp_t const *, fp_t const * );
+static void ann_propagation_delta_output( ann_t const *, ann_workspace_t *, fp_t const *, fp_t const * );
+static void ann_propagation_accumulate( ann_t const *, ann_workspace_t const *, fp_t const *, fp_t *, fp_t );
+static void ann_propagation_fused( ann_t *, ann_workspace_t *, fp_t const *, fp_t const *, fp_t const *, fp_t );
+static void ann_update( ann_t *, fp_t, uint_t, uint_t, uint_t );
+static void ann_optimizer_clear( ann_t * );
+static void ann_checker_range( ann_checker_t *, uint_t, uint_t, uint_t );
+static fp_t ann_checker_difference( ann_checker_t *, uint_t, uint_t, uint_t, fp_t );
+
+static fp_t ann_error( fp_t, fp_t );
+static fp_t ann_error_partial( fp_t, fp_t );
+
+static fp_t ann_sparse_threshold( ann_t const *, uint_t, fp_t );
+static void ann_benchmark_batch( ann_t *, ann_checker_t *, ann_benchmark_mode_t, fp_t const *, fp_t *, fp_t const *, uint_t );
+static int ann_sparse_compare( void const *, void const * );
+static uint_t ann_model_size( ann_t const * );
+
+static fp_t ann_activation_binary( fp_t );
+static fp_t ann_activation_binary_partial( fp_t );
+static fp_t ann_activation_sigmoid( fp_t );
+static fp_t ann_activation_sigmoid_partial( fp_t );
+static fp_t ann_activation_relu( fp_t );
+static fp_t ann_activation_relu_partial( fp_t );
+static fp_t ann_activation_elu( fp_t );
+static fp_t ann_activation_elu_partial( fp_t );
+static fp_t ann_activation_lrelu( fp_t );
+static fp_t ann_activation_lrelu_partial( fp_t );
+static fp_t ann_activation_tanh( fp_t );
+static fp_t ann_activation_tanh_partial( fp_t );
+static fp_t ann_activation_sigmoid_fast( fp_t );
+static fp_t ann_activation_elu_fast( fp_t );
+static fp_t ann_activation_tanh_fast( fp_t );
+
+static void ann_activation_forward( ann_activation_t, fp_t *, uint_t );
+static void ann_activation_backward( ann_activation_t, fp_t const *, fp_t *, uint_t );
+
+
+
+// Lays out the block of a network with layer_n layers of layer_neuron_n
+// neurons, filling the counts and offsets of the header layout
+//
+// Returns -1 if a layer is empty or the block would not fit in a uint_t
+
+static int ann_layout( uint_t layer_n, uint_t const *layer_neuron_n, ann_t *layout )
+{
+	uint64_t neuron_n = 0;
+	uint64_t weight_n = 0;
+
+	// Calculate the number of neurons and weights / biases, bounded as they go
+	// so that neither ann_stride() nor the sums can wrap
+	for( uint_t l = 1; l < layer_n; l++ )
+	{
+		if( layer_neuron_n[l - 1] == 0 || layer_neuron_n[l] == 0 ||
+			layer_neuron_n[l - 1] > UINT32_MAX / sizeof( fp_t ) ||
+			layer_neuron_n[l] > UINT32_MAX / sizeof( fp_t ) )
+		{
+			return -1;
+		}
+
+		neuron_n += ( l < layer_n - 1 ) ? layer_neuron_n[l] : 0;
+		weight_n += ( uint64_t ) layer_neuron_n[l] * ann_stride( layer_neuron_n[l - 1] );
+
+		if( weight_n > UINT32_MAX )
+		{
+			return -1;
+		}
+	}
+
+	uint64_t output_n = layer_neuron_n[layer_n - 1];
+	uint64_t bound = ann_align( sizeof( ann_t ) ) + sizeof( uint_t ) * ( uint64_t ) layer_n +
+		sizeof( fp_t ) * ( 4 * weight_n + 2 * neuron_n + output_n ) + 4 * ANN_ALIGN;
+
+	if( bound > UINT32_MAX )
+	{
+		return -1;
+	}
+
+	// Every array starts on a 64 byte line
+	layout->magic = ANN_MAGIC;
+	layout->version = ANN_VERSION;
+	layout->fp_n = sizeof( fp_t );
+	layout->layer_n = layer_n;
+	layout->neuron_n = neuron_n;
+	layout->weight_n = weight_n;
+	layout->layer_neuron_n_offset = ann_align( sizeof( ann_t ) );
+	layout->weight_offset = ann_align( layout->layer_neuron_n_offset + sizeof( uint_t ) * layer_n );
+	layout->neuron_offset = layout->weight_offset + sizeof( fp_t ) * weight_n;
+	layout->delta_offset = ann_align( layout->neuron_offset + sizeof( fp_t ) * neuron_n );
+	layout->gradient_offset = ann_align( layout->delta_offset + sizeof( fp_t ) * ( neuron_n + output_n ) );
+	layout->moment_offset = layout->gradient_offset + sizeof( fp_t ) * weight_n;
+	layout->variance_offset = layout->moment_offset + sizeof( fp_t ) * weight_n;
+	layout->n = layout->variance_offset + sizeof( fp_t ) * weight_n;
+
+	return 0;
+}
+
+
+// Returns NULL if a layer is empty, the network is too large for a uint_t sized
+// block or the block cannot be allocated
+
+ann_t * ann_init( uint_t layer_n, uint_t *layer_neuron_n )
+{
+	assert( layer_n >= 2 );
+
+	ann_t layout;
+
+	if( ann_layout( layer_n, layer_neuron_n, &layout ) != 0 )
+	{
+		return NULL;
+	}
+
+	// Allocate everything as one structure
+	ann_t *ann = ann_malloc( layout.n );
+
+	if( !ann )
+	{
+		return NULL;
+	}
+
+	// ann_t | layer_neuron_n[] | weight[] | neuron[] | delta[] | gradient[] |
+	//     moment[] | variance[]
+	*ann = layout;
+	memcpy( ann_layer_neuron_n( ann ), layer_neuron_n, sizeof( uint_t ) * layer_n );
+	memset( ann_weight( ann ), 0, sizeof( fp_t ) * ann->weight_n );
+	memset( ann_gradient( ann ), 0, sizeof( fp_t ) * ann->weight_n );
+
+	ann_set_activation(
+		ann,
+		SIGMOID,
+        SIGMOID
+	);
+
+	ann_set_optimizer( ann, SGD );
+
+	return ann;
+}
+
+void ann_free( ann_t *ann )
+{
+    free( ann );
+}
+
+// Copies the model, the activations and the optimizer parameters into a new
+// network. Only the model part is read, so a network from ann_map() can be
+// copied too, and as with ann_load() the optimizer state starts cleared.
+
+ann_t * ann_copy( ann_t const *ann )
+{
+	ann_t *copy = ann_init( ann->layer_n, ann_layer_neuron_n( ann ) );
+
+	if( !copy )
+	{
+		return NULL;
+	}
+
+	// ann_init() lays out the same offsets from the same layer sizes
+	memcpy( copy, ann, ann_model_size( ann ) );
+	ann_optimizer_clear( copy );
+
+	return copy;
+}
+
+
+ann_workspace_t * ann_workspace_init( ann_t const *ann )
+{
+	uint_t neuron_offset = ann_align( sizeof( ann_workspace_t ) );
+	uint_t delta_offset = ann_align( neuron_offset + sizeof( fp_t ) * ann->neuron_n );
+	uint_t n = delta_offset + sizeof( fp_t ) * ( ann->neuron_n + ann_layer_neuron_n( ann )[ann->layer_n - 1] );
+
+	// ann_workspace_t | neuron[] | delta[]
+	ann_workspace_t *workspace = ann_malloc( n );
+
+	workspace->n = n;
+	workspace->neuron_n = ann->neuron_n;
+	workspace->neuron = ( fp_t * ) ( ( uint8_t * ) workspace + neuron_offset );
+	workspace->delta = ( fp_t * ) ( ( uint8_t * ) workspace + delta_offset );
+
+	return workspace;
+}
+
+void ann_workspace_free( ann_workspace_t *workspace )
+{
+	free( workspace );
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// KERNEL
+////////////////////////////////////////////////////////////////////////////////
+
+
+// Vector extensions have no sqrt() or exp(), the kernels that need them take
+// them lane by lane.
+
+
+// y = sum[0,n){ x_i * w_i }
+
+ANN_SIMD static fp_t ann_dot( fp_t const *x, fp_t const *w, uint_t n )
+{
+	fp_t y = 0;
+	uint_t i = 0;
+
+#ifdef ANN_VECTOR
+	ann_vector_t y_v = { 0 };
+	ann_vector_t x_v, w_v;
+
+	for( ; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+	{
+		memcpy( &x_v, x + i, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w + i, sizeof( ann_vector_t ) );
+		y_v += x_v * w_v;
+	}
+
+	for( uint_t k = 0; k < ANN_LANE_N; k++ )
+	{
+		y += y_v[k];
+	}
+#endif
+
+	for( ; i < n; i++ )
+	{
+		y += x[i] * w[i];
+	}
+
+	return y;
+}
+
+
+// y_i = y_i + a * x_i
+
+ANN_SIMD static void ann_axpy( fp_t a, fp_t const *x, fp_t *y, uint_t n )
+{
+	uint_t i = 0;
+
+#ifdef ANN_VECTOR
+	ann_vector_t x_v, y_v;
+
+	for( ; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+	{
+		memcpy( &x_v, x + i, sizeof( ann_vector_t ) );
+		memcpy( &y_v, y + i, sizeof( ann_vector_t ) );
+		y_v += a * x_v;
+		memcpy( y + i, &y_v, sizeof( ann_vector_t ) );
+	}
+#endif
+
+	for( ; i < n; i++ )
+	{
+		y[i] += a * x[i];
+	}
+}
+
+
+// y = sum[0,n){ w_k * x_c_k }, gathering x through the column indices c
+//
+// Four independent sums hide the latency of the gathered loads
+
+static fp_t ann_dot_sparse( fp_t const *w, uint_t const *c, fp_t const *x, uint_t n )
+{
+	fp_t y[4] = { 0 };
+	uint_t k = 0;
+
+	for( ; k + 4 <= n; k += 4 )
+	{
+		y[0] += w[k + 0] * x[c[k + 0]];
+		y[1] += w[k + 1] * x[c[k + 1]];
+		y[2] += w[k + 2] * x[c[k + 2]];
+		y[3] += w[k + 3] * x[c[k + 3]];
+	}
+
+	for( ; k < n; k++ )
+	{
+		y[0] += w[k] * x[c[k]];
+	}
+
+	return ( y[0] + y[1] ) + ( y[2] + y[3] );
+}
+
+
+// Register tiled kernels
+//
+// The kernels below work on four weight rows, stride apart, at once so every
+// load of x or y is shared by four rows. Each output is accumulated in the
+// same order as ann_dot() and ann_axpy(), but where the compiler contracts the
+// multiplies and adds into FMAs it may do so differently in each kernel. The
+// results agree to within 1e-12 * ( 1 + |y| ) in double and 1e-5 * ( 1 + |y| )
+// in float, and are identical with -ffp-contract=off or ANN_NO_SIMD.
+
+// y_r = sum[0,n){ x_i * w_ri }, r = 0..3
+
+ANN_SIMD static void ann_dot4( fp_t const *x, fp_t const *w, uint_t stride, uint_t n, fp_t *y )
+{
+	fp_t const *w0 = w, *w1 = w + stride, *w2 = w + 2 * stride, *w3 = w + 3 * stride;
+	fp_t y0 = 0, y1 = 0, y2 = 0, y3 = 0;
+	uint_t i = 0;
+
+#ifdef ANN_VECTOR
+	ann_vector_t y0_v = { 0 }, y1_v = { 0 }, y2_v = { 0 }, y3_v = { 0 };
+	ann_vector_t x_v, w_v;
+
+	for( ; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+	{
+		memcpy( &x_v, x + i, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w0 + i, sizeof( ann_vector_t ) );
+		y0_v += x_v * w_v;
+		memcpy( &w_v, w1 + i, sizeof( ann_vector_t ) );
+		y1_v += x_v * w_v;
+		memcpy( &w_v, w2 + i, sizeof( ann_vector_t ) );
+		y2_v += x_v * w_v;
+		memcpy( &w_v, w3 + i, sizeof( ann_vector_t ) );
+		y3_v += x_v * w_v;
+	}
+
+	for( uint_t k = 0; k < ANN_LANE_N; k++ )
+	{
+		y0 += y0_v[k];
+		y1 += y1_v[k];
+		y2 += y2_v[k];
+		y3 += y3_v[k];
+	}
+#endif
+
+	for( ; i < n; i++ )
+	{
+		y0 += x[i] * w0[i];
+		y1 += x[i] * w1[i];
+		y2 += x[i] * w2[i];
+		y3 += x[i] * w3[i];
+	}
+
+	y[0] = y0;
+	y[1] = y1;
+	y[2] = y2;
+	y[3] = y3;
+}
+
+
+// ann_dot4() for two inputs, x and x + x_stride, into y and y + y_stride
+
+ANN_SIMD static void ann_dot4x2( fp_t const *x, uint_t x_stride, fp_t const *w, uint_t stride, uint_t n, fp_t *y, uint_t y_stride )
+{
+	fp_t const *w0 = w, *w1 = w + stride, *w2 = w + 2 * stride, *w3 = w + 3 * stride;
+	fp_t const *z = x + x_stride;
+	fp_t y0 = 0, y1 = 0, y2 = 0, y3 = 0;
+	fp_t z0 = 0, z1 = 0, z2 = 0, z3 = 0;
+	uint_t i = 0;
+
+#ifdef ANN_VECTOR
+	ann_vector_t y0_v = { 0 }, y1_v = { 0 }, y2_v = { 0 }, y3_v = { 0 };
+	ann_vector_t z0_v = { 0 }, z1_v = { 0 }, z2_v = { 0 }, z3_v = { 0 };
+	ann_vector_t x_v, z_v, w_v;
+
+	for( ; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+	{
+		memcpy( &x_v, x + i, sizeof( ann_vector_t ) );
+		memcpy( &z_v, z + i, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w0 + i, sizeof( ann_vector_t ) );
+		y0_v += x_v * w_v;
+		z0_v += z_v * w_v;
+		memcpy( &w_v, w1 + i, sizeof( ann_vector_t ) );
+		y1_v += x_v * w_v;
+		z1_v += z_v * w_v;
+		memcpy( &w_v, w2 + i, sizeof( ann_vector_t ) );
+		y2_v += x_v * w_v;
+		z2_v += z_v * w_v;
+		memcpy( &w_v, w3 + i, sizeof( ann_vector_t ) );
+		y3_v += x_v * w_v;
+		z3_v += z_v * w_v;
+	}
+
+	for( uint_t k = 0; k < ANN_LANE_N; k++ )
+	{
+		y0 += y0_v[k];
+		y1 += y1_v[k];
+		y2 += y2_v[k];
+		y3 += y3_v[k];
+		z0 += z0_v[k];
+		z1 += z1_v[k];
+		z2 += z2_v[k];
+		z3 += z3_v[k];
+	}
+#endif
+
+	for( ; i < n; i++ )
+	{
+		y0 += x[i] * w0[i];
+		y1 += x[i] * w1[i];
+		y2 += x[i] * w2[i];
+		y3 += x[i] * w3[i];
+		z0 += z[i] * w0[i];
+		z1 += z[i] * w1[i];
+		z2 += z[i] * w2[i];
+		z3 += z[i] * w3[i];
+	}
+
+	y[0] = y0;
+	y[1] = y1;
+	y[2] = y2;
+	y[3] = y3;
+	y[y_stride] = z0;
+	y[y_stride + 1] = z1;
+	y[y_stride + 2] = z2;
+	y[y_stride + 3] = z3;
+}
+
+
+// y_i = y_i + a_0 * w_0i + a_1 * w_1i + a_2 * w_2i + a_3 * w_3i
+
+ANN_SIMD static void ann_axpy4( fp_t const *a, fp_t const *w, uint_t stride, fp_t *y, uint_t n )
+{
+	fp_t const *w0 = w, *w1 = w + stride, *w2 = w + 2 * stride, *w3 = w + 3 * stride;
+	uint_t i = 0;
+
+#ifdef ANN_VECTOR
+	ann_vector_t y_v, w_v;
+
+	for( ; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+	{
+		memcpy( &y_v, y + i, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w0 + i, sizeof( ann_vector_t ) );
+		y_v += a[0] * w_v;
+		memcpy( &w_v, w1 + i, sizeof( ann_vector_t ) );
+		y_v += a[1] * w_v;
+		memcpy( &w_v, w2 + i, sizeof( ann_vector_t ) );
+		y_v += a[2] * w_v;
+		memcpy( &w_v, w3 + i, sizeof( ann_vector_t ) );
+		y_v += a[3] * w_v;
+		memcpy( y + i, &y_v, sizeof( ann_vector_t ) );
+	}
+#endif
+
+	for( ; i < n; i++ )
+	{
+		y[i] += a[0] * w0[i];
+		y[i] += a[1] * w1[i];
+		y[i] += a[2] * w2[i];
+		y[i] += a[3] * w3[i];
+	}
+}
+
+
+// w_ri = w_ri + a_r * x_i, r = 0..3
+
+ANN_SIMD static void ann_ger4( fp_t const *a, fp_t const *x, fp_t *w, uint_t stride, uint_t n )
+{
+	fp_t *w0 = w, *w1 = w + stride, *w2 = w + 2 * stride, *w3 = w + 3 * stride;
+	uint_t i = 0;
+
+#ifdef ANN_VECTOR
+	ann_vector_t x_v, w_v;
+
+	for( ; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+	{
+		memcpy( &x_v, x + i, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w0 + i, sizeof( ann_vector_t ) );
+		w_v += a[0] * x_v;
+		memcpy( w0 + i, &w_v, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w1 + i, sizeof( ann_vector_t ) );
+		w_v += a[1] * x_v;
+		memcpy( w1 + i, &w_v, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w2 + i, sizeof( ann_vector_t ) );
+		w_v += a[2] * x_v;
+		memcpy( w2 + i, &w_v, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w3 + i, sizeof( ann_vector_t ) );
+		w_v += a[3] * x_v;
+		memcpy( w3 + i, &w_v, sizeof( ann_vector_t ) );
+	}
+#endif
+
+	for( ; i < n; i++ )
+	{
+		w0[i] += a[0] * x[i];
+		w1[i] += a[1] * x[i];
+		w2[i] += a[2] * x[i];
+		w3[i] += a[3] * x[i];
+	}
+}
+
+
+// y_i = y_i + sum[0,4){ e_r * w_ri }, then w_ri = w_ri + c_r * x_i, r = 0..3
+//
+// ann_axpy4() and ann_ger4() in one pass, each weight being loaded once to
+// propagate the delta through its old value and to update it
+
+ANN_SIMD static void ann_axpy4_ger4( fp_t const *e, fp_t const *c, fp_t const *x, fp_t *w, uint_t stride, fp_t *y, uint_t n )
+{
+	uint_t i = 0;
+
+#ifdef ANN_VECTOR
+	fp_t *w0 = w, *w1 = w + stride, *w2 = w + 2 * stride, *w3 = w + 3 * stride;
+	ann_vector_t x_v, y_v, w_v;
+
+	for( ; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+	{
+		memcpy( &x_v, x + i, sizeof( ann_vector_t ) );
+		memcpy( &y_v, y + i, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w0 + i, sizeof( ann_vector_t ) );
+		y_v += e[0] * w_v;
+		w_v += c[0] * x_v;
+		memcpy( w0 + i, &w_v, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w1 + i, sizeof( ann_vector_t ) );
+		y_v += e[1] * w_v;
+		w_v += c[1] * x_v;
+		memcpy( w1 + i, &w_v, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w2 + i, sizeof( ann_vector_t ) );
+		y_v += e[2] * w_v;
+		w_v += c[2] * x_v;
+		memcpy( w2 + i, &w_v, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w3 + i, sizeof( ann_vector_t ) );
+		y_v += e[3] * w_v;
+		w_v += c[3] * x_v;
+		memcpy( w3 + i, &w_v, sizeof( ann_vector_t ) );
+		memcpy( y + i, &y_v, sizeof( ann_vector_t ) );
+	}
+#endif
+
+	// Interleaved, the scalar loops would no longer vectorize as they do apart,
+	// and the four rows are still in cache for the second
+	ann_axpy4( e, w + i, stride, y + i, n - i );
+	ann_ger4( c, x + i, w + i, stride, n - i );
+}
+
+
+// Optimizer kernels
+//
+// Each reads the summed gradient g once, scales it by s, updates the optimizer
+// state and the weights and clears g, all in one pass.
+
+// w_i = w_i + a * g_i
+
+ANN_SIMD static void ann_update_sgd( fp_t a, fp_t *g, fp_t *w, uint_t n )
+{
+	uint_t i = 0;
+
+#ifdef ANN_VECTOR
+	ann_vector_t g_v, w_v;
+	ann_vector_t zero_v = { 0 };
+
+	for( ; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+	{
+		memcpy( &g_v, g + i, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w + i, sizeof( ann_vector_t ) );
+		w_v += a * g_v;
+		memcpy( w + i, &w_v, sizeof( ann_vector_t ) );
+		memcpy( g + i, &zero_v, sizeof( ann_vector_t ) );
+	}
+#endif
+
+	for( ; i < n; i++ )
+	{
+		w[i] += a * g[i];
+		g[i] = 0;
+	}
+}
+
+
+// v_i = mu * v_i + s * g_i, w_i = w_i - rate * v_i
+
+ANN_SIMD static void ann_update_momentum( fp_t rate, fp_t s, fp_t mu, fp_t *g, fp_t *v, fp_t *w, uint_t n )
+{
+	uint_t i = 0;
+
+#ifdef ANN_VECTOR
+	ann_vector_t g_v, v_v, w_v;
+	ann_vector_t zero_v = { 0 };
+
+	for( ; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+	{
+		memcpy( &g_v, g + i, sizeof( ann_vector_t ) );
+		memcpy( &v_v, v + i, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w + i, sizeof( ann_vector_t ) );
+		v_v = mu * v_v + s * g_v;
+		w_v -= rate * v_v;
+		memcpy( v + i, &v_v, sizeof( ann_vector_t ) );
+		memcpy( w + i, &w_v, sizeof( ann_vector_t ) );
+		memcpy( g + i, &zero_v, sizeof( ann_vector_t ) );
+	}
+#endif
+
+	for( ; i < n; i++ )
+	{
+		v[i] = mu * v[i] + s * g[i];
+		w[i] -= rate * v[i];
+		g[i] = 0;
+	}
+}
+
+
+// m_i = b_1 * m_i + ( 1 - b_1 ) * s * g_i
+// v_i = b_2 * v_i + ( 1 - b_2 ) * ( s * g_i )^2
+// w_i = w_i - c_1 * m_i / ( sqrt( c_2 * v_i ) + eps )
+//
+// c_1 and c_2 fold the rate and the bias correction of the two moments
+
+ANN_SIMD static void ann_update_adam( fp_t c_1, fp_t c_2, fp_t b_1, fp_t b_2, fp_t eps, fp_t s, fp_t *g, fp_t *m, fp_t *v, fp_t *w, uint_t n )
+{
+	uint_t i = 0;
+
+#ifdef ANN_VECTOR
+	ann_vector_t g_v, m_v, v_v, w_v, r_v;
+	ann_vector_t zero_v = { 0 };
+
+	for( ; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+	{
+		memcpy( &g_v, g + i, sizeof( ann_vector_t ) );
+		memcpy( &m_v, m + i, sizeof( ann_vector_t ) );
+		memcpy( &v_v, v + i, sizeof( ann_vector_t ) );
+		memcpy( &w_v, w + i, sizeof( ann_vector_t ) );
+		g_v *= s;
+		m_v = b_1 * m_v + ( 1 - b_1 ) * g_v;
+		v_v = b_2 * v_v + ( 1 - b_2 ) * g_v * g_v;
+		r_v = c_2 * v_v;
+
+		for( uint_t k = 0; k < ANN_LANE_N; k++ )
+		{
+			r_v[k] = sqrt( r_v[k] );
+		}
+
+		w_v -= c_1 * m_v / ( r_v + eps );
+		memcpy( m + i, &m_v, sizeof( ann_vector_t ) );
+		memcpy( v + i, &v_v, sizeof( ann_vector_t ) );
+		memcpy( w + i, &w_v, sizeof( ann_vector_t ) );
+		memcpy( g + i, &zero_v, sizeof( ann_vector_t ) );
+	}
+#endif
+
+	for( ; i < n; i++ )
+	{
+		fp_t g_i = s * g[i];
+
+		m[i] = b_1 * m[i] + ( 1 - b_1 ) * g_i;
+		v[i] = b_2 * v[i] + ( 1 - b_2 ) * g_i * g_i;
+		w[i] -= c_1 * m[i] / ( sqrt( c_2 * v[i] ) + eps );
+		g[i] = 0;
+	}
+}
+
+
+// y_j = exp( y_j - m ) / sum[0,n){ exp( y_k - m ) }, m = max[0,n){ y_k }
+//
+// Shifting by the largest y_k leaves the result unchanged and keeps exp() from
+// overflowing
+
+ANN_SIMD static void ann_softmax( fp_t *y, uint_t n )
+{
+	fp_t m = y[0];
+	fp_t sum = 0;
+	uint_t i = 0;
+
+#ifdef ANN_VECTOR
+	ann_vector_t y_v, m_v, sum_v = { 0 };
+	ann_mask_t greater_v;
+
+	if( n >= ANN_LANE_N )
+	{
+		memcpy( &m_v, y, sizeof( ann_vector_t ) );
+
+		for( i = ANN_LANE_N; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+		{
+			memcpy( &y_v, y + i, sizeof( ann_vector_t ) );
+			greater_v = y_v > m_v;
+			m_v = ( ann_vector_t ) ( ( greater_v & ( ann_mask_t ) y_v ) | ( ~greater_v & ( ann_mask_t ) m_v ) );
+		}
+
+		for( uint_t k = 0; k < ANN_LANE_N; k++ )
+		{
+			m = ( m_v[k] > m ) ? m_v[k] : m;
+		}
+	}
+#endif
+
+	for( ; i < n; i++ )
+	{
+		m = ( y[i] > m ) ? y[i] : m;
+	}
+
+	i = 0;
+
+#ifdef ANN_VECTOR
+	for( ; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+	{
+		memcpy( &y_v, y + i, sizeof( ann_vector_t ) );
+		y_v -= m;
+
+		for( uint_t k = 0; k < ANN_LANE_N; k++ )
+		{
+			y_v[k] = exp( y_v[k] );
+		}
+
+		sum_v += y_v;
+		memcpy( y + i, &y_v, sizeof( ann_vector_t ) );
+	}
+
+	for( uint_t k = 0; k < ANN_LANE_N; k++ )
+	{
+		sum += sum_v[k];
+	}
+#endif
+
+	for( ; i < n; i++ )
+	{
+		y[i] = exp( y[i] - m );
+		sum += y[i];
+	}
+
+	fp_t r = 1 / sum;
+
+	i = 0;
+
+#ifdef ANN_VECTOR
+	for( ; i + ANN_LANE_N <= n; i += ANN_LANE_N )
+	{
+		memcpy( &y_v, y + i, sizeof( ann_vector_t ) );
+		y_v *= r;
+		memcpy( y + i, &y_v, sizeof( ann_vector_t ) );
+	}
+#endif
+
+	for( ; i < n; i++ )
+	{
+		y[i] *= r;
+	}
+}
+
+
+// y_bj = sum[0,x_n){ w_ji * x_bi } + b_j for batch_n inputs x_b
+//
+// w holds y_n rows of x_n weights followed by the bias, see ann_stride(). The batch is split into
+// blocks whose inputs fit in half of the L2 cache, and each group of four
+// weight rows is loaded once per block and applied to two inputs at a time.
+
+static void ann_layer_forward( fp_t const *x, uint_t batch_n, fp_t const *w, uint_t x_n, uint_t y_n, fp_t *y )
+{
+	uint_t stride = ann_stride( x_n );
+	uint_t block_n = ( batch_n > 1 ) ? ann_cache_size() / 2 / ( sizeof( fp_t ) * x_n ) : 1;
+
+	if( block_n < 1 )
+	{
+		block_n = 1;
+	}
+
+	for( uint_t b0 = 0; b0 < batch_n; b0 += block_n )
+	{
+		uint_t b1 = ( b0 + block_n < batch_n ) ? b0 + block_n : batch_n;
+		uint_t j = 0;
+		uint_t b;
+
+		for( ; j + 4 <= y_n; j += 4 )
+		{
+			fp_t const *w_j = w + j * stride;
+
+			for( b = b0; b + 2 <= b1; b += 2 )
+			{
+				ann_dot4x2( x + b * x_n, x_n, w_j, stride, x_n, y + b * y_n + j, y_n );
+			}
+
+			if( b < b1 )
+			{
+				ann_dot4( x + b * x_n, w_j, stride, x_n, y + b * y_n + j );
+			}
+
+			for( b = b0; b < b1; b++ )
+			{
+				for( uint_t r = 0; r < 4; r++ )
+				{
+					y[b * y_n + j + r] += w_j[r * stride + x_n];
+				}
+			}
+		}
+
+		for( ; j < y_n; j++ )
+		{
+			for( b = b0; b < b1; b++ )
+			{
+				y[b * y_n + j] = ann_dot( x + b * x_n, w + j * stride, x_n );
+				y[b * y_n + j] += w[j * stride + x_n];
+			}
+		}
+	}
+}
+
+
+// w_ji = w_ji + a * d_j * x_i, b_j = b_j + a * d_j for the y_n rows of a layer
+
+static void ann_layer_accumulate( fp_t const *x, uint_t x_n, fp_t const *d, uint_t y_n, fp_t *w, fp_t a )
+{
+	uint_t stride = ann_stride( x_n );
+	uint_t j = 0;
+
+	for( ; j + 4 <= y_n; j += 4 )
+	{
+		fp_t a_r[4] = { a * d[j], a * d[j + 1], a * d[j + 2], a * d[j + 3] };
+
+		ann_ger4( a_r, x, w + j * stride, stride, x_n );
+
+		for( uint_t r = 0; r < 4; r++ )
+		{
+			w[( j + r ) * stride + x_n] += a_r[r];
+		}
+	}
+
+	for( ; j < y_n; j++ )
+	{
+		ann_axpy( a * d[j], x, w + j * stride, x_n );
+		w[j * stride + x_n] += a * d[j];
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FORWARD PROPAGATION
+////////////////////////////////////////////////////////////////////////////////
+
+// o_j = s( sum[1,n+1]{w_ij * o_i} )
+//
+// The hidden neurons are kept in the network for ann_propagation_backward()
+
+void ann_propagation_forward( ann_t *ann, fp_t const * const input, fp_t *output )
+{
+	ann_workspace_t workspace = { .neuron = ann_neuron( ann ), .delta = ann_delta( ann ) };
+
+	ann_workspace_forward( ann, &workspace, input, output );
+}
+
+
+// As ann_propagation_forward(), with the hidden neurons kept in workspace. ann
+// is only read, so threads may share it as long as each has its own workspace
+
+void ann_workspace_forward( ann_t const *ann, ann_workspace_t *workspace, fp_t const *input, fp_t *output )
+{
+    fp_t const *w_ij = ann_weight( ann );
+	fp_t const *x = input;           // Input neuron into y
+	fp_t *y = workspace->neuron;     // The current neuron being calculated
+	
+	uint_t l = 1;
+
+	// Hidden Layers
+	for( ; l < ann->layer_n - 1; l++ )
+	{
+	    ann_layer_forward( x, 1, w_ij, ann_layer_neuron_n( ann )[l - 1], ann_layer_neuron_n( ann )[l], y );
+	    w_ij += ann_layer_neuron_n( ann )[l] * ann_stride( ann_layer_neuron_n( ann )[l - 1] );
+
+	    ann_activation_forward( ann->activation_hidden_type, y, ann_layer_neuron_n( ann )[l] );
+
+        x = y;
+		y += ann_layer_neuron_n( ann )[l];
+	}
+
+	// Last layer
+    ann_layer_forward( x, 1, w_ij, ann_layer_neuron_n( ann )[l - 1], ann_layer_neuron_n( ann )[l], output );
+
+    ann_activation_forward( ann->activation_output_type, output, ann_layer_neuron_n( ann )[l] );
+}
+
+
+// Batched forward propagation
+//
+// The batch_n inputs and outputs are stored back to back. Each layer is
+// evaluated for the whole batch before moving to the next, so every weight row
+// is loaded once per cache block and reused across the batch. The batch runs
+// through ann_dot4x2() where a single input runs through ann_dot4(), so the
+// outputs match ann_propagation_forward() only to the tolerance given for the
+// register tiled kernels.
+// The hidden activations are kept in a scratch buffer and the network is left
+// untouched.
+
+void ann_propagation_forward_batch( ann_t const *ann, fp_t const *input, uint_t batch_n, fp_t *output )
+{
+	uint_t width = 1;
+
+	for( uint_t l = 1; l < ann->layer_n - 1; l++ )
+	{
+		if( ann_layer_neuron_n( ann )[l] > width )
+		{
+			width = ann_layer_neuron_n( ann )[l];
+		}
+	}
+
+	// Two hidden layers worth of neurons for the whole batch, x is read from
+	// one half while y is written to the other
+	fp_t *scratch = ann_malloc( sizeof( fp_t ) * 2 * batch_n * width );
+	fp_t const *w_ij = ann_weight( ann );
+	fp_t const *x = input;
+	fp_t *y = scratch;
+	ann_activation_t activation = ann->activation_hidden_type;
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		uint_t x_n = ann_layer_neuron_n( ann )[l - 1];
+		uint_t y_n = ann_layer_neuron_n( ann )[l];
+
+		if( l == ann->layer_n - 1 )
+		{
+			y = output;
+			activation = ann->activation_output_type;
+		}
+
+		ann_layer_forward( x, batch_n, w_ij, x_n, y_n, y );
+		w_ij += y_n * ann_stride( x_n );
+
+		if( activation == SOFTMAX )
+		{
+			// Each sample is normalized on its own
+			for( uint_t b = 0; b < batch_n; b++ )
+			{
+				ann_activation_forward( activation, y + b * y_n, y_n );
+			}
+		}
+		else
+		{
+			ann_activation_forward( activation, y, batch_n * y_n );
+		}
+
+		x = y;
+		y = ( y == scratch ) ? scratch + batch_n * width : scratch;
+	}
+
+	free( scratch );
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TRAINING
+////////////////////////////////////////////////////////////////////////////////
+
+// E = 0.5 * sum[1, o_n+1]{ (o_i - t_i)^2 }
+//
+// Each layer's weight update is fused into the pass that propagates its deltas,
+// see ann_propagation_fused(). Only SGD takes this path, the other optimizers
+// sum the gradient and apply it with ann_gradient_apply().
+
+void ann_propagation_backward( ann_t *ann, fp_t const *input, fp_t *output, fp_t const *target, fp_t rate )
+{
+	ann_workspace_t workspace = { .neuron = ann_neuron( ann ), .delta = ann_delta( ann ) };
+
+	if( ann->optimizer == SGD )
+	{
+		ann_propagation_fused( ann, &workspace, input, output, target, -rate );
+	}
+	else
+	{
+		ann_propagation_delta( ann, &workspace, output, target );
+		ann_propagation_accumulate( ann, &workspace, input, ann_gradient( ann ), 1 );
+		ann_gradient_apply( ann, rate );
+	}
+}
+
+
+// Sums dE/dw for the last ann_workspace_forward() on workspace into gradient,
+// which holds ann->weight_n values. ann is only read.
+
+void ann_workspace_backward( ann_t const *ann, ann_workspace_t *workspace, fp_t const *input, fp_t const *output, fp_t const *target, fp_t *gradient )
+{
+	ann_propagation_delta( ann, workspace, output, target );
+	ann_propagation_accumulate( ann, workspace, input, gradient, 1 );
+}
+
+
+// Computes the output and hidden deltas for the last forward pass
+
+static void ann_propagation_delta( ann_t const *ann, ann_workspace_t *workspace, fp_t const *output, fp_t const *target )
+{
+    int_t l = ann->layer_n - 1;
+    uint_t j, q;
+    
+    // First output layer delta
+	fp_t *d_j = workspace->delta + ann->neuron_n;
+
+	ann_propagation_delta_output( ann, workspace, output, target );
+
+	// First weight in the set between the last layer and the current
+	fp_t const *w_jq = ann_weight( ann ) +
+		ann->weight_n -
+		ann_layer_neuron_n( ann )[l] * ann_stride( ann_layer_neuron_n( ann )[l - 1] );
+
+	fp_t const *o_j = workspace->neuron + ann->neuron_n;
+	fp_t *d_q;
+
+	l--;
+
+	// Hidden Deltas
+	//
+	// d_j = sum[1,q_n]{ w_jq * d_q } walks a column of the weights for every j.
+	// Instead each row q is scaled by d_q and added to all of d_j, which reads
+	// the weights contiguously as the transposed matrix would, without storing it
+	for( ; l > 0; --l )
+	{
+		d_q = d_j;
+		d_j -= ann_layer_neuron_n( ann )[l];
+   		o_j -= ann_layer_neuron_n( ann )[l];
+
+		for( j = 0; j < ann_layer_neuron_n( ann )[l]; j++ )
+		{
+			d_j[j] = 0;
+		}
+
+		q = 0;
+
+		for( ; q + 4 <= ann_layer_neuron_n( ann )[l + 1]; q += 4 )
+		{
+			ann_axpy4( d_q + q, w_jq + q * ann_stride( ann_layer_neuron_n( ann )[l] ), ann_stride( ann_layer_neuron_n( ann )[l] ), d_j, ann_layer_neuron_n( ann )[l] );
+		}
+
+		for( ; q < ann_layer_neuron_n( ann )[l + 1]; q++ )
+		{
+			ann_axpy( d_q[q], w_jq + q * ann_stride( ann_layer_neuron_n( ann )[l] ), d_j, ann_layer_neuron_n( ann )[l] );
+		}
+
+		ann_activation_backward( ann->activation_hidden_type, o_j, d_j, ann_layer_neuron_n( ann )[l] );
+
+		w_jq -= ann_layer_neuron_n( ann )[l] * ann_stride( ann_layer_neuron_n( ann )[l - 1] );
+	}
+}
+
+
+// Output Deltas
+//
+// ( o_j - t_j ) * s'( z_j ) for the squared error, or ( o_j - t_j ) alone for
+// SOFTMAX against the cross-entropy error
+
+static void ann_propagation_delta_output( ann_t const *ann, ann_workspace_t *workspace, fp_t const *output, fp_t const *target )
+{
+	uint_t o_n = ann_layer_neuron_n( ann )[ann->layer_n - 1];
+	fp_t *d_j = workspace->delta + ann->neuron_n;
+
+	for( uint_t j = 0; j < o_n; j++ )
+	{
+		d_j[j] = ann_error_partial( output[j], target[j] );
+	}
+
+	ann_activation_backward( ann->activation_output_type, output, d_j, o_n );
+}
+
+
+// w = w + a * dE/dw
+//
+// Walks the weights in order, w being either the weights or a gradient, using
+// the deltas from ann_propagation_delta()
+
+static void ann_propagation_accumulate( ann_t const *ann, ann_workspace_t const *workspace, fp_t const *input, fp_t *w, fp_t a )
+{
+	fp_t *w_ij = w;
+	fp_t const *d_j = workspace->delta;
+	uint_t l = 1;
+
+	// Input training
+	ann_layer_accumulate( input, ann_layer_neuron_n( ann )[l - 1], d_j, ann_layer_neuron_n( ann )[l], w_ij, a );
+	w_ij += ann_layer_neuron_n( ann )[l] * ann_stride( ann_layer_neuron_n( ann )[l - 1] );
+
+	l++;
+	fp_t const *i_i = workspace->neuron;
+
+	// Hidden training
+	for( ; l < ann->layer_n; l++ )
+	{
+		d_j += ann_layer_neuron_n( ann )[l - 1];
+
+		ann_layer_accumulate( i_i, ann_layer_neuron_n( ann )[l - 1], d_j, ann_layer_neuron_n( ann )[l], w_ij, a );
+		w_ij += ann_layer_neuron_n( ann )[l] * ann_stride( ann_layer_neuron_n( ann )[l - 1] );
+    
+		i_i += ann_layer_neuron_n( ann )[l - 1];
+	}
+}
+
+
+// w = w + a * dE/dw, a layer at a time from the output
+//
+// As ann_propagation_delta() followed by ann_propagation_accumulate() on the
+// weights, with the same results, but each layer is updated as soon as its
+// deltas have been propagated to the layer below. Every row is read once for
+// both through ann_axpy4_ger4(), instead of once in each of the two passes.
+
+static void ann_propagation_fused( ann_t *ann, ann_workspace_t *workspace, fp_t const *input, fp_t const *output, fp_t const *target, fp_t a )
+{
+	uint_t const *layer_neuron_n = ann_layer_neuron_n( ann );
+	uint_t l = ann->layer_n - 1;
+
+	fp_t *w_jq = ann_weight( ann ) + ann->weight_n - layer_neuron_n[l] * ann_stride( layer_neuron_n[l - 1] );
+	fp_t *d_q = workspace->delta + ann->neuron_n;
+	fp_t *o_j = workspace->neuron + ann->neuron_n;
+
+	ann_propagation_delta_output( ann, workspace, output, target );
+
+	for( ; l > 1; l-- )
+	{
+		uint_t x_n = layer_neuron_n[l - 1];
+		uint_t stride = ann_stride( x_n );
+		fp_t *d_j = d_q - x_n;
+		uint_t q = 0;
+
+		o_j -= x_n;
+
+		for( uint_t j = 0; j < x_n; j++ )
+		{
+			d_j[j] = 0;
+		}
+
+		// d_j = sum[1,q_n]{ w_jq * d_q } through the old rows, then w_jq = w_jq + a * d_q * o_j
+		for( ; q + 4 <= layer_neuron_n[l]; q += 4 )
+		{
+			fp_t c_r[4] = { a * d_q[q], a * d_q[q + 1], a * d_q[q + 2], a * d_q[q + 3] };
+
+			ann_axpy4_ger4( d_q + q, c_r, o_j, w_jq + q * stride, stride, d_j, x_n );
+
+			for( uint_t r = 0; r < 4; r++ )
+			{
+				w_jq[( q + r ) * stride + x_n] += c_r[r];
+			}
+		}
+
+		for( ; q < layer_neuron_n[l]; q++ )
+		{
+			ann_axpy( d_q[q], w_jq + q * stride, d_j, x_n );
+			ann_axpy( a * d_q[q], o_j, w_jq + q * stride, x_n );
+			w_jq[q * stride + x_n] += a * d_q[q];
+		}
+
+		ann_activation_backward( ann->activation_hidden_type, o_j, d_j, x_n );
+
+		d_q = d_j;
+		w_jq -= x_n * ann_stride( layer_neuron_n[l - 2] );
+	}
+
+	// The first layer has no deltas below it
+	ann_layer_accumulate( input, layer_neuron_n[0], d_q, layer_neuron_n[1], w_jq, a );
+}
+
+
+// Mini-batch training
+//
+// The gradient for a sample is summed into ann_gradient() instead of being
+// applied to the weights. ann_gradient_apply() then updates every weight in one
+// pass and clears the gradient.
+
+void ann_gradient_accumulate( ann_t *ann, fp_t const *input, fp_t const *output, fp_t const *target )
+{
+	ann_workspace_t workspace = { .neuron = ann_neuron( ann ), .delta = ann_delta( ann ) };
+
+	ann_workspace_backward( ann, &workspace, input, output, target, ann_gradient( ann ) );
+}
+
+
+void ann_gradient_apply( ann_t *ann, fp_t rate )
+{
+	ann->step_n++;
+	ann_update( ann, rate, 1, 0, ann->weight_n );
+}
+
+
+// Applies the gradient, summed over batch_n samples, to the weights [begin, end)
+// with the selected optimizer and clears it. The caller advances step_n once per
+// update, so an update can be split across threads.
+
+static void ann_update( ann_t *ann, fp_t rate, uint_t batch_n, uint_t begin, uint_t end )
+{
+	fp_t *g = ann_gradient( ann ) + begin;
+	fp_t *m = ann_moment( ann ) + begin;
+	fp_t *v = ann_variance( ann ) + begin;
+	fp_t *w = ann_weight( ann ) + begin;
+
+	switch( ann->optimizer )
+	{
+		case SGD:
+			ann_update_sgd( -rate / batch_n, g, w, end - begin );
+			break;
+
+		case MOMENTUM:
+			ann_update_momentum( rate, ( fp_t ) 1 / batch_n, ann->beta_1, g, m, w, end - begin );
+			break;
+
+		case ADAM:
+			ann_update_adam(
+				rate / ( 1 - pow( ann->beta_1, ( fp_t ) ann->step_n ) ),
+				1 / ( 1 - pow( ann->beta_2, ( fp_t ) ann->step_n ) ),
+				ann->beta_1,
+				ann->beta_2,
+				ann->epsilon,
+				( fp_t ) 1 / batch_n,
+				g, m, v, w,
+				end - begin
+			);
+			break;
+	}
+}
+
+
+// Trains on batch_n samples stored back to back in input and target, applying
+// the mean gradient of the batch once
+
+void ann_train_batch( ann_t *ann, fp_t const *input, fp_t const *target, uint_t batch_n, fp_t rate )
+{
+	uint_t input_n = ann_layer_neuron_n( ann )[0];
+	uint_t output_n = ann_layer_neuron_n( ann )[ann->layer_n - 1];
+	fp_t output[output_n];
+
+	for( uint_t b = 0; b < batch_n; b++ )
+	{
+		ann_propagation_forward( ann, input + b * input_n, output );
+		ann_gradient_accumulate( ann, input + b * input_n, output, target + b * output_n );
+	}
+
+	ann->step_n++;
+	ann_update( ann, rate, batch_n, 0, ann->weight_n );
+}
+
+
+// Trains on the numeric gradient of one sample, checker being made for ann by
+// ann_checker_init()
+
+void ann_train_numeric( ann_t *ann, ann_checker_t *checker, fp_t const *input, fp_t const *target, fp_t rate )
+{
+	assert( checker->ann == ann );
+
+	memset( ann_gradient( ann ), 0, sizeof( fp_t ) * ann->weight_n );
+	ann_checker_gradient( checker, input, target, ann_gradient( ann ) );
+	ann_gradient_apply( ann, rate );
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// GRADIENT CHECK
+////////////////////////////////////////////////////////////////////////////////
+
+
+// thread_n is the most threads ann_checker_gradient_pool() will be run with
+
+ann_checker_t * ann_checker_init( ann_t const *ann, uint_t thread_n )
+{
+	uint_t const *layer_neuron_n = ann_layer_neuron_n( ann );
+	uint_t output_n = layer_neuron_n[ann->layer_n - 1];
+	uint_t width = 0;
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		if( layer_neuron_n[l] > width )
+		{
+			width = layer_neuron_n[l];
+		}
+	}
+
+	// Every array, and every thread's slice of scratch[], starts on a 64 byte
+	// line so the threads never share one
+	uint_t scratch_n = ann_align( sizeof( fp_t ) * 2 * ( width + output_n ) ) / sizeof( fp_t );
+	uint_t z_offset = ann_align( sizeof( ann_checker_t ) );
+	uint_t a_offset = ann_align( z_offset + sizeof( fp_t ) * ( ann->neuron_n + output_n ) );
+	uint_t scratch_offset = ann_align( a_offset + sizeof( fp_t ) * ( ann->neuron_n + output_n ) );
+	uint_t layer_offset_offset = scratch_offset + sizeof( fp_t ) * thread_n * scratch_n;
+	uint_t weight_offset_offset = ann_align( layer_offset_offset + sizeof( uint_t ) * ann->layer_n );
+	uint_t n = weight_offset_offset + sizeof( uint_t ) * ann->layer_n;
+
+	// ann_checker_t | z[] | a[] | scratch[] | layer_offset[] | weight_offset[]
+	ann_checker_t *checker = ann_malloc( n );
+
+	checker->n = n;
+	checker->ann = ann;
+	checker->thread_n = thread_n;
+	checker->width = width;
+	checker->z = ( fp_t * ) ( ( uint8_t * ) checker + z_offset );
+	checker->a = ( fp_t * ) ( ( uint8_t * ) checker + a_offset );
+	checker->scratch = ( fp_t * ) ( ( uint8_t * ) checker + scratch_offset );
+	checker->scratch_n = scratch_n;
+	checker->layer_offset = ( uint_t * ) ( ( uint8_t * ) checker + layer_offset_offset );
+	checker->weight_offset = ( uint_t * ) ( ( uint8_t * ) checker + weight_offset_offset );
+
+	// The step has to stay well above the rounding error of fp_t
+	checker->epsilon = ( sizeof( fp_t ) < sizeof( double ) ) ? 1e-3 : 1e-8;
+
+	checker->layer_offset[0] = 0;
+	checker->weight_offset[0] = 0;
+	checker->layer_offset[1] = 0;
+	checker->weight_offset[1] = 0;
+
+	for( uint_t l = 2; l < ann->layer_n; l++ )
+	{
+		checker->layer_offset[l] = checker->layer_offset[l - 1] + layer_neuron_n[l - 1];
+		checker->weight_offset[l] = checker->weight_offset[l - 1] + layer_neuron_n[l - 1] * ann_stride( layer_neuron_n[l - 2] );
+	}
+
+	return checker;
+}
+
+
+void ann_checker_free( ann_checker_t *checker )
+{
+	free( checker );
+}
+
+
+// Caches z and a for input, layer l being at layer_offset[l]
+
+static void ann_checker_forward( ann_checker_t *checker, fp_t const *input )
+{
+	ann_t const *ann = checker->ann;
+	uint_t const *layer_neuron_n = ann_layer_neuron_n( ann );
+	fp_t const *x = input;
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		fp_t *z = checker->z + checker->layer_offset[l];
+		fp_t *a = checker->a + checker->layer_offset[l];
+
+		ann_layer_forward( x, 1, ann_weight( ann ) + checker->weight_offset[l], layer_neuron_n[l - 1], layer_neuron_n[l], z );
+		memcpy( a, z, sizeof( fp_t ) * layer_neuron_n[l] );
+		ann_activation_forward( ( l == ann->layer_n - 1 ) ? ann->activation_output_type : ann->activation_hidden_type, a, layer_neuron_n[l] );
+
+		x = a;
+	}
+}
+
+
+// Sums dE/dw_i ~= ( E( w_i + epsilon ) - E( w_i - epsilon ) ) / ( 2 * epsilon )
+// for every weight of ann into gradient, E being ann_error_total() of input
+// against target, or ann_error_cross_entropy() for SOFTMAX outputs
+
+void ann_checker_gradient( ann_checker_t *checker, fp_t const *input, fp_t const *target, fp_t *gradient )
+{
+	checker->input = input;
+	checker->target = target;
+	checker->gradient = gradient;
+
+	ann_checker_forward( checker, input );
+	ann_checker_range( checker, 0, 0, checker->ann->weight_n );
+}
+
+
+// Computes the gradient for the weights [begin, end) with scratch space slot
+//
+// w_lji moves z_lj by +- epsilon * x_i. When x_i is 0 neither side changes
+// and the gradient is 0.
+
+static void ann_checker_range( ann_checker_t *checker, uint_t slot, uint_t begin, uint_t end )
+{
+	ann_t const *ann = checker->ann;
+	uint_t const *layer_neuron_n = ann_layer_neuron_n( ann );
+	fp_t epsilon = checker->epsilon;
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		uint_t stride = ann_stride( layer_neuron_n[l - 1] );
+		uint_t k_0 = checker->weight_offset[l];
+		uint_t k_1 = k_0 + layer_neuron_n[l] * stride;
+		fp_t const *x = ( l == 1 ) ? checker->input : checker->a + checker->layer_offset[l - 1];
+
+		if( k_1 <= begin || k_0 >= end )
+		{
+			continue;
+		}
+
+		for( uint_t k = ( begin > k_0 ) ? begin : k_0; k < k_1 && k < end; k++ )
+		{
+			uint_t j = ( k - k_0 ) / stride;
+			uint_t i = ( k - k_0 ) % stride;
+			fp_t x_i = ( i < layer_neuron_n[l - 1] ) ? x[i] : ( i == layer_neuron_n[l - 1] ) ? 1 : 0;
+
+			// Row padding has x_i = 0 too
+			if( x_i != 0 )
+			{
+				checker->gradient[k] += ann_checker_difference( checker, slot, l, j, epsilon * x_i ) / ( 2 * epsilon );
+			}
+		}
+	}
+}
+
+
+// E( z_lj + dz ) - E( z_lj - dz ), propagating only from layer l onward
+//
+// An output neuron only changes its own error, unless the outputs are SOFTMAX
+// which couples all of them. A hidden neuron changes every pre-activation of
+// layer l + 1 by w_qj * da, after which the remaining layers are run in full.
+
+static fp_t ann_checker_difference( ann_checker_t *checker, uint_t slot, uint_t l, uint_t j, fp_t dz )
+{
+	ann_t const *ann = checker->ann;
+	uint_t const *layer_neuron_n = ann_layer_neuron_n( ann );
+	uint_t layer_n = ann->layer_n;
+	uint_t output_n = layer_neuron_n[layer_n - 1];
+	fp_t const *z = checker->z + checker->layer_offset[l];
+	fp_t const *a = checker->a + checker->layer_offset[l];
+	fp_t const *target = checker->target;
+
+	fp_t *y = checker->scratch + slot * checker->scratch_n;
+	fp_t *output = y + 2 * checker->width;
+
+	if( l == layer_n - 1 && ann->activation_output_type == SOFTMAX )
+	{
+		for( uint_t side = 0; side < 2; side++ )
+		{
+			fp_t *o = output + side * output_n;
+
+			memcpy( o, z, sizeof( fp_t ) * output_n );
+			o[j] += ( side == 0 ) ? dz : -dz;
+			ann_activation_forward( SOFTMAX, o, output_n );
+		}
+
+		return ann_error_cross_entropy( output, target, output_n ) - ann_error_cross_entropy( output + output_n, target, output_n );
+	}
+
+	if( l == layer_n - 1 )
+	{
+		fp_t upper = z[j] + dz;
+		fp_t lower = z[j] - dz;
+
+		ann_activation_forward( ann->activation_output_type, &upper, 1 );
+		ann_activation_forward( ann->activation_output_type, &lower, 1 );
+
+		return ann_error( upper, target[j] ) - ann_error( lower, target[j] );
+	}
+
+	fp_t const *base = checker->a + checker->layer_offset[layer_n - 1];
+	fp_t const *o[2];
+
+	for( uint_t side = 0; side < 2; side++ )
+	{
+		fp_t a_j = z[j] + ( side == 0 ? dz : -dz );
+
+		ann_activation_forward( ann->activation_hidden_type, &a_j, 1 );
+
+		fp_t da = a_j - a[j];
+
+		// The activation is flat here, nothing downstream moves
+		if( da == 0 )
+		{
+			o[side] = base;
+			continue;
+		}
+
+		// Layer l + 1 from its cached pre-activations
+		uint_t q_n = layer_neuron_n[l + 1];
+		uint_t stride = ann_stride( layer_neuron_n[l] );
+		fp_t const *w_qj = ann_weight( ann ) + checker->weight_offset[l + 1] + j;
+		fp_t const *z_q = checker->z + checker->layer_offset[l + 1];
+		fp_t *x = ( l + 1 == layer_n - 1 ) ? output + side * output_n : y;
+
+		for( uint_t q = 0; q < q_n; q++ )
+		{
+			x[q] = z_q[q] + w_qj[q * stride] * da;
+		}
+
+		ann_activation_forward( ( l + 1 == layer_n - 1 ) ? ann->activation_output_type : ann->activation_hidden_type, x, q_n );
+
+		// The remaining layers in full, alternating between the two scratch layers
+		for( uint_t m = l + 2; m < layer_n; m++ )
+		{
+			fp_t *x_next = ( m == layer_n - 1 ) ? output + side * output_n : ( x == y ) ? y + checker->width : y;
+
+			ann_layer_forward( x, 1, ann_weight( ann ) + checker->weight_offset[m], layer_neuron_n[m - 1], layer_neuron_n[m], x_next );
+			ann_activation_forward( ( m == layer_n - 1 ) ? ann->activation_output_type : ann->activation_hidden_type, x_next, layer_neuron_n[m] );
+
+			x = x_next;
+		}
+
+		o[side] = output + side * output_n;
+	}
+
+	if( ann->activation_output_type == SOFTMAX )
+	{
+		return ann_error_cross_entropy( o[0], target, output_n ) - ann_error_cross_entropy( o[1], target, output_n );
+	}
+
+	fp_t difference = 0;
+
+	for( uint_t k = 0; k < output_n; k++ )
+	{
+		difference += ann_error( o[0][k], target[k] ) - ann_error( o[1][k], target[k] );
+	}
+
+	return difference;
+}
+
+
+#ifdef ANN_THREAD
+
+
+// Thread i checks its contiguous share of the weights
+
+static void ann_checker_task( void *argument, uint_t i, uint_t thread_n )
+{
+	ann_checker_t *checker = argument;
+	uint_t weight_n = checker->ann->weight_n;
+
+	ann_checker_range( checker, i, ( uint_t ) ( ( uint64_t ) weight_n * i / thread_n ), ( uint_t ) ( ( uint64_t ) weight_n * ( i + 1 ) / thread_n ) );
+}
+
+
+// As ann_checker_gradient(), with the weights split across the threads of pool
+
+void ann_checker_gradient_pool( ann_checker_t *checker, ann_pool_t *pool, fp_t const *input, fp_t const *target, fp_t *gradient )
+{
+	assert( ann_pool_thread_n( pool ) <= checker->thread_n );
+
+	checker->input = input;
+	checker->target = target;
+	checker->gradient = gradient;
+
+	ann_checker_forward( checker, input );
+	ann_pool_run( pool, ann_checker_task, checker );
+}
+
+
+#endif // ANN_THREAD
+
+
+////////////////////////////////////////////////////////////////////////////////
+// PARALLEL TRAINING
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef ANN_THREAD
+
+
+ann_trainer_t * ann_trainer_init( ann_t *ann, ann_pool_t *pool )
+{
+	uint_t worker_n = ann_pool_thread_n( pool );
+
+	// Padded rows make every worker's gradient a whole number of lines
+	uint_t gradient_offset = ann_align( sizeof( ann_trainer_t ) );
+
+	// ann_trainer_t | gradient[] | workspace[]
+	ann_trainer_t *trainer = ann_malloc( gradient_offset +
+		sizeof( fp_t ) * worker_n * ann->weight_n +
+		sizeof( ann_workspace_t * ) * worker_n );
+
+	trainer->ann = ann;
+	trainer->pool = pool;
+	trainer->gradient = ( fp_t * ) ( ( uint8_t * ) trainer + gradient_offset );
+	trainer->workspace = ( ann_workspace_t ** ) ( trainer->gradient + worker_n * ann->weight_n );
+	memset( trainer->gradient, 0, sizeof( fp_t ) * worker_n * ann->weight_n );
+
+	for( uint_t i = 0; i < worker_n; i++ )
+	{
+		trainer->workspace[i] = ann_workspace_init( ann );
+	}
+
+	return trainer;
+}
+
+
+void ann_trainer_free( ann_trainer_t *trainer )
+{
+	for( uint_t i = 0; i < ann_pool_thread_n( trainer->pool ); i++ )
+	{
+		ann_workspace_free( trainer->workspace[i] );
+	}
+
+	free( trainer );
+}
+
+
+// Thread i accumulates the gradient of its contiguous share of the batch
+
+static void ann_trainer_accumulate( void *argument, uint_t i, uint_t thread_n )
+{
+	ann_trainer_t *trainer = argument;
+	ann_t const *ann = trainer->ann;
+	ann_workspace_t *workspace = trainer->workspace[i];
+	fp_t *gradient = trainer->gradient + i * ann->weight_n;
+	uint_t input_n = ann_layer_neuron_n( ann )[0];
+	uint_t output_n = ann_layer_neuron_n( ann )[ann->layer_n - 1];
+	fp_t output[output_n];
+
+	for( uint_t b = trainer->batch_n * i / thread_n; b < trainer->batch_n * ( i + 1 ) / thread_n; b++ )
+	{
+		ann_workspace_forward( ann, workspace, trainer->input + b * input_n, output );
+		ann_workspace_backward( ann, workspace, trainer->input + b * input_n, output, trainer->target + b * output_n, gradient );
+	}
+}
+
+
+// Thread i sums the worker gradients over its share of the weights, always in
+// worker order so the result does not depend on scheduling, and applies them
+
+static void ann_trainer_reduce( void *argument, uint_t i, uint_t thread_n )
+{
+	ann_trainer_t *trainer = argument;
+	ann_t *ann = trainer->ann;
+
+	// Shares are whole cache lines so threads do not write to the same line
+	uint_t line_n = 64 / sizeof( fp_t );
+	uint_t slice_n = ( ann->weight_n + line_n - 1 ) / line_n;
+	uint_t begin = slice_n * i / thread_n * line_n;
+	uint_t end = slice_n * ( i + 1 ) / thread_n * line_n;
+
+	if( end > ann->weight_n )
+	{
+		end = ann->weight_n;
+	}
+
+	if( begin >= end )
+	{
+		return;
+	}
+
+	for( uint_t k = 0; k < thread_n; k++ )
+	{
+		fp_t *gradient = trainer->gradient + k * ann->weight_n;
+
+		ann_axpy( 1, gradient + begin, ann_gradient( ann ) + begin, end - begin );
+		memset( gradient + begin, 0, sizeof( fp_t ) * ( end - begin ) );
+	}
+
+	ann_update( ann, trainer->rate, trainer->batch_n, begin, end );
+}
+
+
+// Trains on batch_n samples stored back to back in input and target, as
+// ann_train_batch() does. The result is deterministic for a given thread count.
+
+void ann_trainer_batch( ann_trainer_t *trainer, fp_t const *input, fp_t const *target, uint_t batch_n, fp_t rate )
+{
+	trainer->input = input;
+	trainer->target = target;
+	trainer->batch_n = batch_n;
+	trainer->rate = rate;
+
+	ann_pool_run( trainer->pool, ann_trainer_accumulate, trainer );
+	trainer->ann->step_n++;
+	ann_pool_run( trainer->pool, ann_trainer_reduce, trainer );
+}
+
+
+#endif // ANN_THREAD
+
+
+////////////////////////////////////////////////////////////////////////////////
+// PARALLEL INFERENCE
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef ANN_THREAD
+
+
+// One layer of a forward pass, split by output neuron
+
+typedef struct
+{
+	fp_t const *x;
+	fp_t const *w;
+	uint_t x_n;
+	uint_t y_n;
+	fp_t *y;
+	ann_activation_t activation;
+} ann_layer_task_t;
+
+
+// Thread i computes its contiguous share of the neurons, in whole blocks of
+// four so the register tiles, and the results, match a single thread
+
+static void ann_layer_task( void *argument, uint_t i, uint_t thread_n )
+{
+	ann_layer_task_t const *task = argument;
+	uint_t block_n = ( task->y_n + 3 ) / 4;
+	uint_t j_0 = 4 * ( block_n * i / thread_n );
+	uint_t j_1 = 4 * ( block_n * ( i + 1 ) / thread_n );
+
+	j_1 = ( j_1 < task->y_n ) ? j_1 : task->y_n;
+
+	ann_layer_forward( task->x, 1, task->w + j_0 * ann_stride( task->x_n ), task->x_n, j_1 - j_0, task->y + j_0 );
+
+	// SOFTMAX needs the whole layer, it is left to the caller
+	if( task->activation != SOFTMAX )
+	{
+		ann_activation_forward( task->activation, task->y + j_0, j_1 - j_0 );
+	}
+}
+
+
+// As ann_propagation_forward(), with every wide layer split across pool
+
+void ann_propagation_forward_pool( ann_t *ann, ann_pool_t *pool, fp_t const *input, fp_t *output )
+{
+	ann_workspace_t workspace = { .neuron = ann_neuron( ann ), .delta = ann_delta( ann ) };
+
+	ann_workspace_forward_pool( ann, &workspace, pool, input, output );
+}
+
+
+// As ann_workspace_forward(), with the neurons of every layer of at least
+// ANN_POOL_LAYER_MIN multiply-adds split across the threads of pool. The
+// return of ann_pool_run() is the barrier before the next layer reads them.
+// Narrower layers run on the calling thread alone.
+
+void ann_workspace_forward_pool( ann_t const *ann, ann_workspace_t *workspace, ann_pool_t *pool, fp_t const *input, fp_t *output )
+{
+	uint_t thread_n = ann_pool_thread_n( pool );
+	fp_t const *w_ij = ann_weight( ann );
+	fp_t const *x = input;
+	fp_t *y = workspace->neuron;
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		ann_layer_task_t task =
+		{
+			.x = x,
+			.w = w_ij,
+			.x_n = ann_layer_neuron_n( ann )[l - 1],
+			.y_n = ann_layer_neuron_n( ann )[l],
+			.y = ( l == ann->layer_n - 1 ) ? output : y,
+			.activation = ( l == ann->layer_n - 1 ) ? ann->activation_output_type : ann->activation_hidden_type,
+		};
+
+		if( thread_n > 1 && ( uint64_t ) task.x_n * task.y_n >= ANN_POOL_LAYER_MIN && task.y_n >= 4 * thread_n )
+		{
+			ann_pool_run( pool, ann_layer_task, &task );
+		}
+		else
+		{
+			ann_layer_task( &task, 0, 1 );
+		}
+
+		if( task.activation == SOFTMAX )
+		{
+			ann_activation_forward( SOFTMAX, task.y, task.y_n );
+		}
+
+		w_ij += task.y_n * ann_stride( task.x_n );
+		x = task.y;
+		y += task.y_n;
+	}
+}
+
+
+#endif // ANN_THREAD
+
+
+////////////////////////////////////////////////////////////////////////////////
+// LOADER
+////////////////////////////////////////////////////////////////////////////////
+
+
+#if defined( ANN_THREAD ) && defined( BIN_H )
+
+
+static void * ann_loader_thread( void * );
+
+
+// Opens path for streaming batches of batch_n samples sized for ann, shuffled
+// within window_n samples from the seed random. Returns NULL if the file can't
+// be read or its blocks are too small for the samples.
+
+ann_loader_t * ann_loader_init( ann_t const *ann, char const *path, uint_t offset, uint_t batch_n, uint_t window_n, uint64_t random )
+{
+	assert( batch_n >= 1 && window_n >= 1 );
+
+	FILE *file = fopen( path, "rb" );
+	bin_meta_t meta;
+
+	if( !file )
+	{
+		return NULL;
+	}
+
+	uint_t input_n = ann_layer_neuron_n( ann )[0];
+	uint_t output_n = ann_layer_neuron_n( ann )[ann->layer_n - 1];
+	uint_t sample_n = input_n + output_n;
+
+	if( fread( &meta, sizeof( bin_meta_t ), 1, file ) != 1 ||
+		meta.block_size < offset + sizeof( fp_t ) * sample_n )
+	{
+		fclose( file );
+		return NULL;
+	}
+
+	// About a megabyte of blocks per read
+	uint_t chunk_n = ( meta.block_size < ( 1 << 20 ) ) ? ( 1 << 20 ) / meta.block_size : 1;
+
+	uint_t window_offset = ann_align( sizeof( ann_loader_t ) );
+	uint_t batch_offset = ann_align( window_offset + sizeof( fp_t ) * window_n * sample_n );
+	uint_t chunk_offset = ann_align( batch_offset + sizeof( fp_t ) * 2 * batch_n * sample_n );
+	uint_t n = chunk_offset + chunk_n * meta.block_size;
+
+	// ann_loader_t | window[] | batch[][] | chunk[]
+	ann_loader_t *loader = ann_malloc( n );
+
+	loader->n = n;
+	loader->file = file;
+	loader->length = meta.length;
+	loader->block_size = meta.block_size;
+	loader->offset = offset;
+	loader->input_n = input_n;
+	loader->output_n = output_n;
+	loader->batch_n = batch_n;
+	loader->window_n = window_n;
+	loader->chunk = ( uint8_t * ) loader + chunk_offset;
+	loader->chunk_n = chunk_n;
+	loader->window = ( fp_t * ) ( ( uint8_t * ) loader + window_offset );
+	loader->random = random ? random : 1;
+	loader->batch[0] = ( fp_t * ) ( ( uint8_t * ) loader + batch_offset );
+	loader->batch[1] = loader->batch[0] + batch_n * sample_n;
+	loader->full[0] = loader->full[1] = 0;
+	loader->turn = 0;
+	loader->held = 0;
+	loader->stop = 0;
+
+	pthread_mutex_init( &loader->mutex, NULL );
+	pthread_cond_init( &loader->changed, NULL );
+	pthread_create( &loader->thread, NULL, ann_loader_thread, loader );
+
+	return loader;
+}
+
+
+void ann_loader_free( ann_loader_t *loader )
+{
+	pthread_mutex_lock( &loader->mutex );
+	loader->stop = 1;
+	pthread_cond_broadcast( &loader->changed );
+	pthread_mutex_unlock( &loader->mutex );
+
+	pthread_join( loader->thread, NULL );
+
+	pthread_cond_destroy( &loader->changed );
+	pthread_mutex_destroy( &loader->mutex );
+	fclose( loader->file );
+	free( loader );
+}
+
+
+// Hands out the next batch, its inputs and targets stored back to back as for
+// ann_train_batch(), and returns its sample count. They stay valid until the
+// next call. A count of 0 marks the end of a pass over the file, the call after
+// it starting the next pass.
+
+uint_t ann_loader_next( ann_loader_t *loader, fp_t const **input, fp_t const **target )
+{
+	pthread_mutex_lock( &loader->mutex );
+
+	// Give the last batch back to be refilled
+	if( loader->held )
+	{
+		loader->full[loader->turn] = 0;
+		loader->turn ^= 1;
+		pthread_cond_broadcast( &loader->changed );
+	}
+
+	while( !loader->full[loader->turn] )
+	{
+		pthread_cond_wait( &loader->changed, &loader->mutex );
+	}
+
+	loader->held = 1;
+
+	uint_t count = loader->count[loader->turn];
+	fp_t const *batch = loader->batch[loader->turn];
+
+	pthread_mutex_unlock( &loader->mutex );
+
+	*input = batch;
+	*target = batch + loader->batch_n * loader->input_n;
+
+	return count;
+}
+
+
+// Reads the next sample of the file into sample, returning 0 past the end
+
+static int ann_loader_read( ann_loader_t *loader, fp_t *sample )
+{
+	if( loader->chunk_i == loader->chunk_count )
+	{
+		uint64_t left = loader->length - loader->read_i;
+		uint_t chunk_n = ( left < loader->chunk_n ) ? ( uint_t ) left : loader->chunk_n;
+
+		loader->chunk_i = 0;
+		loader->chunk_count = ( chunk_n > 0 ) ? fread( loader->chunk, loader->block_size, chunk_n, loader->file ) : 0;
+		loader->read_i += loader->chunk_count;
+
+		if( loader->chunk_count == 0 )
+		{
+			return 0;
+		}
+	}
+
+	memcpy( sample, loader->chunk + loader->chunk_i * loader->block_size + loader->offset, sizeof( fp_t ) * ( loader->input_n + loader->output_n ) );
+	loader->chunk_i++;
+
+	return 1;
+}
+
+
+// Fills the batches in turn, pass after pass over the file, until freed
+
+static void * ann_loader_thread( void *argument )
+{
+	ann_loader_t *loader = argument;
+	uint_t sample_n = loader->input_n + loader->output_n;
+	uint_t turn = 0;
+
+	for( ;; )
+	{
+		fseek( loader->file, sizeof( bin_meta_t ), SEEK_SET );
+		loader->read_i = 0;
+		loader->chunk_i = loader->chunk_count = 0;
+		loader->window_count = 0;
+
+		while( loader->window_count < loader->window_n &&
+			ann_loader_read( loader, loader->window + loader->window_count * sample_n ) )
+		{
+			loader->window_count++;
+		}
+
+		// One more batch than there are samples for, the last one being empty
+		int last = 0;
+
+		while( !last )
+		{
+			pthread_mutex_lock( &loader->mutex );
+
+			while( loader->full[turn] && !loader->stop )
+			{
+				pthread_cond_wait( &loader->changed, &loader->mutex );
+			}
+
+			int stop = loader->stop;
+
+			pthread_mutex_unlock( &loader->mutex );
+
+			if( stop )
+			{
+				return NULL;
+			}
+
+			fp_t *input = loader->batch[turn];
+			fp_t *target = input + loader->batch_n * loader->input_n;
+			uint_t count = 0;
+
+			last = ( loader->window_count == 0 );
+
+			// Draw from the window and refill the slot from the file, or close
+			// the gap with the last sample once the file runs out
+			for( ; count < loader->batch_n && loader->window_count > 0; count++ )
+			{
+				// xorshift64*
+				loader->random ^= loader->random >> 12;
+				loader->random ^= loader->random << 25;
+				loader->random ^= loader->random >> 27;
+
+				uint_t k = ( uint_t ) ( ( loader->random * 0x2545F4914F6CDD1DULL ) >> 32 ) % loader->window_count;
+				fp_t *sample = loader->window + k * sample_n;
+
+				memcpy( input + count * loader->input_n, sample, sizeof( fp_t ) * loader->input_n );
+				memcpy( target + count * loader->output_n, sample + loader->input_n, sizeof( fp_t ) * loader->output_n );
+
+				if( !ann_loader_read( loader, sample ) )
+				{
+					loader->window_count--;
+					memcpy( sample, loader->window + loader->window_count * sample_n, sizeof( fp_t ) * sample_n );
+				}
+			}
+
+			pthread_mutex_lock( &loader->mutex );
+			loader->count[turn] = count;
+			loader->full[turn] = 1;
+			pthread_cond_broadcast( &loader->changed );
+			pthread_mutex_unlock( &loader->mutex );
+
+			turn ^= 1;
+		}
+	}
+}
+
+
+#endif // ANN_THREAD && BIN_H
+
+
+////////////////////////////////////////////////////////////////////////////////
+// SERVING
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef ANN_THREAD
+
+
+// Latency percentiles are taken over this many of the most recent requests
+
+#define ANN_QUEUE_LATENCY_N 4096
+
+
+static void * ann_queue_thread( void * );
+
+
+ann_queue_t * ann_queue_init( ann_t const *ann, uint_t batch_max, double deadline )
+{
+	assert( batch_max >= 1 );
+
+	uint_t input_n = ann_layer_neuron_n( ann )[0];
+	uint_t output_n = ann_layer_neuron_n( ann )[ann->layer_n - 1];
+
+	uint_t input_offset = ann_align( sizeof( ann_queue_t ) );
+	uint_t output_offset = ann_align( input_offset + sizeof( fp_t ) * batch_max * input_n );
+	uint_t latency_offset = ann_align( output_offset + sizeof( fp_t ) * batch_max * output_n );
+	uint_t n = latency_offset + sizeof( double ) * ANN_QUEUE_LATENCY_N;
+
+	// ann_queue_t | input[] | output[] | latency[]
+	ann_queue_t *queue = ann_malloc( n );
+
+	queue->n = n;
+	queue->ann = ann;
+	queue->batch_max = batch_max;
+	queue->deadline = deadline;
+	queue->input = ( fp_t * ) ( ( uint8_t * ) queue + input_offset );
+	queue->output = ( fp_t * ) ( ( uint8_t * ) queue + output_offset );
+	queue->head = queue->tail = NULL;
+	queue->pending_n = 0;
+	queue->latency = ( double * ) ( ( uint8_t * ) queue + latency_offset );
+	queue->latency_n = ANN_QUEUE_LATENCY_N;
+	queue->latency_i = 0;
+	queue->batch_n = 0;
+	queue->stop = 0;
+
+	// Deadlines are waited for on the clock of ann_time()
+	pthread_condattr_t attribute;
+
+	pthread_condattr_init( &attribute );
+	pthread_condattr_setclock( &attribute, CLOCK_MONOTONIC );
+
+	pthread_mutex_init( &queue->mutex, NULL );
+	pthread_cond_init( &queue->submitted, &attribute );
+	pthread_cond_init( &queue->completed, NULL );
+	pthread_condattr_destroy( &attribute );
+
+	pthread_create( &queue->thread, NULL, ann_queue_thread, queue );
+
+	return queue;
+}
+
+
+// Runs whatever is still pending, then stops the dispatcher
+
+void ann_queue_free( ann_queue_t *queue )
+{
+	pthread_mutex_lock( &queue->mutex );
+	queue->stop = 1;
+	pthread_cond_broadcast( &queue->submitted );
+	pthread_mutex_unlock( &queue->mutex );
+
+	pthread_join( queue->thread, NULL );
+
+	pthread_cond_destroy( &queue->completed );
+	pthread_cond_destroy( &queue->submitted );
+	pthread_mutex_destroy( &queue->mutex );
+	free( queue );
+}
+
+
+// Queues input, output being written once ann_queue_wait() on request returns.
+// request, input and output are the caller's until then.
+
+void ann_queue_submit( ann_queue_t *queue, ann_queue_request_t *request, fp_t const *input, fp_t *output )
+{
+	request->input = input;
+	request->output = output;
+	request->done = 0;
+	request->next = NULL;
+
+	pthread_mutex_lock( &queue->mutex );
+
+	request->time = ann_time();
+
+	if( queue->tail )
+	{
+		queue->tail->next = request;
+	}
+	else
+	{
+		queue->head = request;
+	}
+
+	queue->tail = request;
+	queue->pending_n++;
+
+	pthread_cond_signal( &queue->submitted );
+	pthread_mutex_unlock( &queue->mutex );
+}
+
+
+void ann_queue_wait( ann_queue_t *queue, ann_queue_request_t *request )
+{
+	pthread_mutex_lock( &queue->mutex );
+
+	while( !request->done )
+	{
+		pthread_cond_wait( &queue->completed, &queue->mutex );
+	}
+
+	pthread_mutex_unlock( &queue->mutex );
+}
+
+
+// As ann_propagation_forward(), batched with the other callers
+
+void ann_queue_forward( ann_queue_t *queue, fp_t const *input, fp_t *output )
+{
+	ann_queue_request_t request;
+
+	ann_queue_submit( queue, &request, input, output );
+	ann_queue_wait( queue, &request );
+}
+
+
+void ann_queue_stats( ann_queue_t *queue, ann_queue_stats_t *stats )
+{
+	double latency[ANN_QUEUE_LATENCY_N];
+
+	pthread_mutex_lock( &queue->mutex );
+
+	uint_t n = ( queue->latency_i < queue->latency_n ) ? ( uint_t ) queue->latency_i : queue->latency_n;
+
+	memcpy( latency, queue->latency, sizeof( double ) * n );
+	stats->request_n = queue->latency_i;
+	stats->batch_n = queue->batch_n;
+
+	pthread_mutex_unlock( &queue->mutex );
+
+	qsort( latency, n, sizeof( double ), ann_time_compare );
+
+	stats->p50 = ( n > 0 ) ? latency[( n - 1 ) / 2] : 0;
+	stats->p99 = ( n > 0 ) ? latency[( uint_t ) ceil( 0.99 * n ) - 1] : 0;
+}
+
+
+// Waits for the first request, then for the batch to fill or the deadline of
+// the oldest request to pass, and runs what it has
+
+static void * ann_queue_thread( void *argument )
+{
+	ann_queue_t *queue = argument;
+	uint_t input_n = ann_layer_neuron_n( queue->ann )[0];
+	uint_t output_n = ann_layer_neuron_n( queue->ann )[queue->ann->layer_n - 1];
+
+	pthread_mutex_lock( &queue->mutex );
+
+	for( ;; )
+	{
+		while( queue->pending_n == 0 && !queue->stop )
+		{
+			pthread_cond_wait( &queue->submitted, &queue->mutex );
+		}
+
+		if( queue->pending_n == 0 )
+		{
+			break;
+		}
+
+		double deadline = queue->head->time + queue->deadline;
+
+		while( queue->pending_n < queue->batch_max && !queue->stop && ann_time() < deadline )
+		{
+			struct timespec t;
+
+			t.tv_sec = ( time_t ) deadline;
+			t.tv_nsec = ( long ) ( ( deadline - t.tv_sec ) * 1e9 );
+
+			pthread_cond_timedwait( &queue->submitted, &queue->mutex, &t );
+		}
+
+		// Take the oldest batch_max requests
+		ann_queue_request_t *first = queue->head;
+		ann_queue_request_t *request = first;
+		uint_t batch_n = 0;
+
+		for( ; request && batch_n < queue->batch_max; request = request->next, batch_n++ )
+		{
+			memcpy( queue->input + batch_n * input_n, request->input, sizeof( fp_t ) * input_n );
+		}
+
+		queue->head = request;
+		queue->tail = request ? queue->tail : NULL;
+		queue->pending_n -= batch_n;
+
+		pthread_mutex_unlock( &queue->mutex );
+
+		ann_propagation_forward_batch( queue->ann, queue->input, batch_n, queue->output );
+
+		pthread_mutex_lock( &queue->mutex );
+
+		double time = ann_time();
+		request = first;
+
+		// A request's next is read before it is marked done, after which its
+		// caller may reuse it
+		for( uint_t b = 0; b < batch_n; b++ )
+		{
+			ann_queue_request_t *next = request->next;
+
+			memcpy( request->output, queue->output + b * output_n, sizeof( fp_t ) * output_n );
+			queue->latency[queue->latency_i++ % queue->latency_n] = time - request->time;
+			request->done = 1;
+			request = next;
+		}
+
+		queue->batch_n++;
+
+		pthread_cond_broadcast( &queue->completed );
+	}
+
+	pthread_mutex_unlock( &queue->mutex );
+
+	return NULL;
+}
+
+
+#endif // ANN_THREAD
+
+
+////////////////////////////////////////////////////////////////////////////////
+// ACTIVATION
+////////////////////////////////////////////////////////////////////////////////
+
+
+static fp_t ann_activation_binary( fp_t x )
+{
+	return ( x > 0.0 ) ? 1.0 : 0.0;
+}
+
+
+static fp_t ann_activation_binary_partial( fp_t x )
+{
+	return 0.0;
+}
+
+static fp_t ann_activation_sigmoid( fp_t x )
+{
+	return 1.0 / ( 1.0 + exp( -x ) );
+}
+
+
+static fp_t ann_activation_sigmoid_partial( fp_t x )
+{
+	return x * ( 1.0 - x );
+}
+
+
+static fp_t ann_activation_relu( fp_t x )
+{
+	return ( x > 0.0 ) ? x : 0.0;
+}
+
+
+static fp_t ann_activation_relu_partial( fp_t x )
+{
+	return ( x > 0.0 ) ? 1.0 : 0.0;
+}
+
+
+static fp_t ann_activation_elu( fp_t x )
+{
+	return ( x > 0.0 ) ? x : ELU_ALPHA * ( expm1( x ) );
+}
+
+
+static fp_t ann_activation_elu_partial( fp_t x )
+{
+	return ( x > 0.0 ) ? 1.0 : x + ELU_ALPHA;
+}
+
+
+static fp_t ann_activation_lrelu( fp_t x )
+{
+	return ( x > 0.0 ) ? x : LRELU_ALPHA * x;
+}
+
+
+static fp_t ann_activation_lrelu_partial( fp_t x )
+{
+    return ( x > 0.0 ) ? 1.0 : LRELU_ALPHA;
+}
+
+
+static fp_t ann_activation_tanh( fp_t x )
+{
+    return tanh( x );
+}
+
+
+static fp_t ann_activation_tanh_partial( fp_t x )
+{
+	return 1.0 - ( x * x );
+}
+
+
+// Fast approximations
+//
+// Branch free and libm free, so the layer kernels vectorize them. The partial
+// derivatives are taken from the output, so they are shared with the exact
+// activations. Maximum absolute error against libm, in double and in float:
+//
+//   TANH_FAST     2.6e-7  /  3.3e-7
+//   SIGMOID_FAST  1.3e-7  /  2.3e-7
+//   ELU_FAST      2.6e-8  /  5.2e-8
+
+// Odd rational approximation of degree 13 / 6 over [-7.9053, 7.9053]. tanh
+// rounds to +-1 in single precision beyond that range.
+
+static fp_t ann_activation_tanh_fast( fp_t x )
+{
+	const fp_t limit = 7.90531110763549805;
+
+	x = ( x > limit ) ? limit : ( x < -limit ) ? -limit : x;
+
+	fp_t x2 = x * x;
+	fp_t p = ( fp_t ) -2.76076847742355e-16;
+	p = p * x2 + ( fp_t ) 2.00018790482477e-13;
+	p = p * x2 + ( fp_t ) -8.60467152213735e-11;
+	p = p * x2 + ( fp_t ) 5.12229709037114e-08;
+	p = p * x2 + ( fp_t ) 1.48572235717979e-05;
+	p = p * x2 + ( fp_t ) 6.37261928875436e-04;
+	p = p * x2 + ( fp_t ) 4.89352455891786e-03;
+
+	fp_t q = ( fp_t ) 1.19825839466702e-06;
+	q = q * x2 + ( fp_t ) 1.18534705686654e-04;
+	q = q * x2 + ( fp_t ) 2.26843463243900e-03;
+	q = q * x2 + ( fp_t ) 4.89352518554385e-03;
+
+	return x * p / q;
+}
+
+
+// s( x ) = 0.5 + 0.5 * tanh( x / 2 )
+
+static fp_t ann_activation_sigmoid_fast( fp_t x )
+{
+	return ( fp_t ) 0.5 + ( fp_t ) 0.5 * ann_activation_tanh_fast( ( fp_t ) 0.5 * x );
+}
+
+
+// e^x - 1 = 2 * t / ( 1 - t ), t = tanh( x / 2 )
+//
+// Evaluated for min( x, 0 ) so both sides of the select are always finite
+
+static fp_t ann_activation_elu_fast( fp_t x )
+{
+	fp_t t = ann_activation_tanh_fast( ( fp_t ) 0.5 * ( ( x < 0 ) ? x : 0 ) );
+
+	return ( x > 0 ) ? x : ( fp_t ) ELU_ALPHA * 2 * t / ( 1 - t );
+}
+
+
+// Layer kernels
+//
+// The activation is selected once per layer rather than called through a
+// function pointer for every neuron. Each case is a plain loop over the layer
+// that the compiler can inline and vectorize.
+
+// y_j = s( y_j )
+
+ANN_SIMD static void ann_activation_forward( ann_activation_t activation, fp_t *y, uint_t n )
+{
+	uint_t j;
+
+	switch( activation )
+	{
+		case IDENTITY:
+			break;
+
+		case BINARY:
+			for( j = 0; j < n; j++ )
+			{
+				y[j] = ann_activation_binary( y[j] );
+			}
+
+			break;
+
+		case SIGMOID:
+			for( j = 0; j < n; j++ )
+			{
+				y[j] = ann_activation_sigmoid( y[j] );
+			}
+
+			break;
+
+		case RELU:
+			for( j = 0; j < n; j++ )
+			{
+				y[j] = ann_activation_relu( y[j] );
+			}
+
+			break;
+
+		case ELU:
+			for( j = 0; j < n; j++ )
+			{
+				y[j] = ann_activation_elu( y[j] );
+			}
+
+			break;
+
+		case LRELU:
+			for( j = 0; j < n; j++ )
+			{
+				y[j] = ann_activation_lrelu( y[j] );
+			}
+
+			break;
+
+		case TANH:
+			for( j = 0; j < n; j++ )
+			{
+				y[j] = ann_activation_tanh( y[j] );
+			}
+
+			break;
+
+		case SIGMOID_FAST:
+			for( j = 0; j < n; j++ )
+			{
+				y[j] = ann_activation_sigmoid_fast( y[j] );
+			}
+
+			break;
+
+		case ELU_FAST:
+			for( j = 0; j < n; j++ )
+			{
+				y[j] = ann_activation_elu_fast( y[j] );
+			}
+
+			break;
+
+		case TANH_FAST:
+			for( j = 0; j < n; j++ )
+			{
+				y[j] = ann_activation_tanh_fast( y[j] );
+			}
+
+			break;
+
+		case SOFTMAX:
+			ann_softmax( y, n );
+
+			break;
+	}
+}
+
+
+// d_j = d_j * s'( o_j )
+
+ANN_SIMD static void ann_activation_backward( ann_activation_t activation, fp_t const *o, fp_t *d, uint_t n )
+{
+	uint_t j;
+
+	switch( activation )
+	{
+		// With the cross-entropy error dE/dz_j = o_j - t_j, which is already the
+		// output delta, so the softmax Jacobian is never formed
+		case IDENTITY:
+		case SOFTMAX:
+			break;
+
+		case BINARY:
+			for( j = 0; j < n; j++ )
+			{
+				d[j] *= ann_activation_binary_partial( o[j] );
+			}
+
+			break;
+
+		case SIGMOID:
+		case SIGMOID_FAST:
+			for( j = 0; j < n; j++ )
+			{
+				d[j] *= ann_activation_sigmoid_partial( o[j] );
+			}
+
+			break;
+
+		case RELU:
+			for( j = 0; j < n; j++ )
+			{
+				d[j] *= ann_activation_relu_partial( o[j] );
+			}
+
+			break;
+
+		case ELU:
+		case ELU_FAST:
+			for( j = 0; j < n; j++ )
+			{
+				d[j] *= ann_activation_elu_partial( o[j] );
+			}
+
+			break;
+
+		case LRELU:
+			for( j = 0; j < n; j++ )
+			{
+				d[j] *= ann_activation_lrelu_partial( o[j] );
+			}
+
+			break;
+
+		case TANH:
+		case TANH_FAST:
+			for( j = 0; j < n; j++ )
+			{
+				d[j] *= ann_activation_tanh_partial( o[j] );
+			}
+
+			break;
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// ERROR
+////////////////////////////////////////////////////////////////////////////////
+
+
+// Mean Squared Error
+//
+// MSE = 0.5 * ( x - y )^2
+// ( y - x )
+
+fp_t ann_error( fp_t o, fp_t t )
+{
+	fp_t e = o - t;
+	e = 0.5 * e * e;
 
 	return e;
 }
 
 
-// Partial Derivative of Mean Squared Error  ( ∂/∂y )
+// Partial Derivative of Mean Squared Error  ( ∂/∂y )
+
+fp_t ann_error_partial( fp_t o, fp_t t )
+{
+	return ( o - t );
+}
+
+
+// Error Function
+// E = 0.5 * sum_[i=1,n]{ ( o_i - t_i )^2 }
+
+fp_t ann_error_total( fp_t const *o, fp_t const *t, uint_t n )
+{
+	fp_t error = 0;
+	for( uint_t i = 0; i < n; i++ )
+	{
+		error += ann_error( o[i], t[i] );
+	}
+
+	return error;
+}
+
+
+// Cross-Entropy Error, for SOFTMAX outputs
+// E = -sum_[i=1,n]{ t_i * log( o_i ) }
+//
+// An output that underflowed to 0 is taken as the smallest normal fp_t
+
+fp_t ann_error_cross_entropy( fp_t const *o, fp_t const *t, uint_t n )
+{
+	fp_t o_min = ( sizeof( fp_t ) < sizeof( double ) ) ? FLT_MIN : DBL_MIN;
+	fp_t error = 0;
+
+	for( uint_t i = 0; i < n; i++ )
+	{
+		if( t[i] != 0 )
+		{
+			error -= t[i] * log( ( o[i] > o_min ) ? o[i] : o_min );
+		}
+	}
+
+	return error;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// QUANTIZATION
+////////////////////////////////////////////////////////////////////////////////
+
+
+// Quantizes a trained network to int8 weights with one scale per weight row.
+// The inputs to each layer are quantized with a per layer scale, calibrated
+// from the largest activation seen over the sample_n inputs in sample.
+
+ann_quant_t * ann_quant_init( ann_t *ann, fp_t const *sample, uint_t sample_n )
+{
+	uint_t row_n = 0;
+	uint_t weight_n = 0;
+	uint_t width = 0;
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		row_n += ann_layer_neuron_n( ann )[l];
+		weight_n += ann_layer_neuron_n( ann )[l] * ann_layer_neuron_n( ann )[l - 1];
+	}
+
+	for( uint_t l = 0; l < ann->layer_n; l++ )
+	{
+		if( ann_layer_neuron_n( ann )[l] > width )
+		{
+			width = ann_layer_neuron_n( ann )[l];
+		}
+	}
+
+	uint_t layer_neuron_n_offset = ann_align( sizeof( ann_quant_t ) );
+	uint_t scale_input_offset = ann_align( layer_neuron_n_offset + sizeof( uint_t ) * ann->layer_n );
+	uint_t scale_weight_offset = ann_align( scale_input_offset + sizeof( fp_t ) * ( ann->layer_n - 1 ) );
+	uint_t bias_offset = ann_align( scale_weight_offset + sizeof( fp_t ) * row_n );
+	uint_t weight_offset = ann_align( bias_offset + sizeof( fp_t ) * row_n );
+	uint_t n = weight_offset + sizeof( int8_t ) * weight_n;
+
+	// ann_quant_t | layer_neuron_n[] | scale_input[] | scale_weight[] | bias[] | weight[]
+	ann_quant_t *quant = ann_malloc( n );
+
+	quant->n = n;
+	quant->layer_n = ann->layer_n;
+	quant->width = width;
+	quant->weight_n = weight_n;
+	quant->layer_neuron_n = ( uint_t * ) ( ( uint8_t * ) quant + layer_neuron_n_offset );
+	memcpy( quant->layer_neuron_n, ann_layer_neuron_n( ann ), sizeof( uint_t ) * ann->layer_n );
+	quant->scale_input = ( fp_t * ) ( ( uint8_t * ) quant + scale_input_offset );
+	quant->scale_weight = ( fp_t * ) ( ( uint8_t * ) quant + scale_weight_offset );
+	quant->bias = ( fp_t * ) ( ( uint8_t * ) quant + bias_offset );
+	quant->weight = ( int8_t * ) ( ( uint8_t * ) quant + weight_offset );
+	quant->activation_hidden_type = ann->activation_hidden_type;
+	quant->activation_output_type = ann->activation_output_type;
+
+	// Calibration, the largest input magnitude seen by each layer
+	fp_t output[ann_layer_neuron_n( ann )[ann->layer_n - 1]];
+
+	for( uint_t l = 0; l < ann->layer_n - 1; l++ )
+	{
+		quant->scale_input[l] = 0;
+	}
+
+	for( uint_t s = 0; s < sample_n; s++ )
+	{
+		fp_t const *x = sample + s * ann_layer_neuron_n( ann )[0];
+
+		ann_propagation_forward( ann, x, output );
+
+		for( uint_t l = 0; l < ann->layer_n - 1; l++ )
+		{
+			for( uint_t i = 0; i < ann_layer_neuron_n( ann )[l]; i++ )
+			{
+				if( fabs( x[i] ) > quant->scale_input[l] )
+				{
+					quant->scale_input[l] = fabs( x[i] );
+				}
+			}
+
+			x = ( l == 0 ) ? ann_neuron( ann ) : x + ann_layer_neuron_n( ann )[l];
+		}
+	}
+
+	for( uint_t l = 0; l < ann->layer_n - 1; l++ )
+	{
+		quant->scale_input[l] = ( quant->scale_input[l] > 0 ) ? quant->scale_input[l] / 127 : 1;
+	}
+
+	// Weights, symmetric per row
+	fp_t const *w_ij = ann_weight( ann );
+	int8_t *q_ij = quant->weight;
+	uint_t r = 0;
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		for( uint_t j = 0; j < ann_layer_neuron_n( ann )[l]; j++, r++ )
+		{
+			fp_t max = 0;
+
+			for( uint_t i = 0; i < ann_layer_neuron_n( ann )[l - 1]; i++ )
+			{
+				if( fabs( w_ij[i] ) > max )
+				{
+					max = fabs( w_ij[i] );
+				}
+			}
+
+			quant->scale_weight[r] = ( max > 0 ) ? max / 127 : 1;
+
+			for( uint_t i = 0; i < ann_layer_neuron_n( ann )[l - 1]; i++ )
+			{
+				*q_ij++ = ( int8_t ) round( w_ij[i] / quant->scale_weight[r] );
+			}
+
+			quant->bias[r] = w_ij[ann_layer_neuron_n( ann )[l - 1]];
+			w_ij += ann_stride( ann_layer_neuron_n( ann )[l - 1] );
+		}
+	}
+
+	return quant;
+}
+
+
+void ann_quant_free( ann_quant_t *quant )
+{
+	free( quant );
+}
+
+
+// o_j = s( s_x * s_wj * sum[1,n]{ q_ij * q_i } + b_j )
+
+void ann_quant_propagation_forward( ann_quant_t const *quant, fp_t const *input, fp_t *output )
+{
+	int8_t x_q[quant->width];
+	fp_t y[quant->width];
+
+	fp_t const *x = input;
+	int8_t const *w_ij = quant->weight;
+	fp_t const *s_wj = quant->scale_weight;
+	fp_t const *b_j = quant->bias;
+
+	for( uint_t l = 1; l < quant->layer_n; l++ )
+	{
+		uint_t x_n = quant->layer_neuron_n[l - 1];
+		fp_t s_x = quant->scale_input[l - 1];
+		fp_t *o_j = ( l == quant->layer_n - 1 ) ? output : y;
+		ann_activation_t activation = ( l == quant->layer_n - 1 ) ?
+			quant->activation_output_type :
+			quant->activation_hidden_type;
+
+		// Quantize the layer input, clamped to the calibrated range
+		for( uint_t i = 0; i < x_n; i++ )
+		{
+			fp_t q = round( x[i] / s_x );
+			x_q[i] = ( int8_t ) ( ( q > 127 ) ? 127 : ( q < -127 ) ? -127 : q );
+		}
+
+		for( uint_t j = 0; j < quant->layer_neuron_n[l]; j++ )
+		{
+			o_j[j] = s_x * *s_wj++ * ann_dot_q8( x_q, w_ij, x_n ) + *b_j++;
+			w_ij += x_n;
+		}
+
+		ann_activation_forward( activation, o_j, quant->layer_neuron_n[l] );
+
+		x = o_j;
+	}
+}
+
+
+// The largest absolute difference between the outputs of the quantized network
+// and the network it was built from, over the sample_n inputs in sample
+
+fp_t ann_quant_error( ann_quant_t const *quant, ann_t *ann, fp_t const *sample, uint_t sample_n )
+{
+	uint_t output_n = ann_layer_neuron_n( ann )[ann->layer_n - 1];
+	fp_t expected[output_n], actual[output_n];
+	fp_t error = 0;
+
+	for( uint_t s = 0; s < sample_n; s++ )
+	{
+		ann_propagation_forward( ann, sample + s * ann_layer_neuron_n( ann )[0], expected );
+		ann_quant_propagation_forward( quant, sample + s * ann_layer_neuron_n( ann )[0], actual );
+
+		for( uint_t i = 0; i < output_n; i++ )
+		{
+			if( fabs( expected[i] - actual[i] ) > error )
+			{
+				error = fabs( expected[i] - actual[i] );
+			}
+		}
+	}
+
+	return error;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// SPARSE
+////////////////////////////////////////////////////////////////////////////////
+
+
+// Prunes a trained network by magnitude. In every layer the smallest sparsity
+// fraction of the weights, and any weight that is already 0, are dropped. The
+// biases are all kept. ann is only read.
+
+ann_sparse_t * ann_sparse_init( ann_t const *ann, fp_t sparsity )
+{
+	uint_t const *layer_neuron_n = ann_layer_neuron_n( ann );
+	fp_t threshold[ann->layer_n];
+	uint_t row_n = 0;
+	uint_t weight_n = 0;
+	uint_t width = 0;
+
+	for( uint_t l = 0; l < ann->layer_n; l++ )
+	{
+		if( layer_neuron_n[l] > width )
+		{
+			width = layer_neuron_n[l];
+		}
+	}
+
+	// Count the weights kept, |w| > threshold
+	fp_t const *w_ij = ann_weight( ann );
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		threshold[l] = ann_sparse_threshold( ann, l, sparsity );
+
+		for( uint_t j = 0; j < layer_neuron_n[l]; j++ )
+		{
+			for( uint_t i = 0; i < layer_neuron_n[l - 1]; i++ )
+			{
+				weight_n += fabs( w_ij[i] ) > threshold[l];
+			}
+
+			w_ij += ann_stride( layer_neuron_n[l - 1] );
+		}
+
+		row_n += layer_neuron_n[l];
+	}
+
+	uint_t layer_neuron_n_offset = ann_align( sizeof( ann_sparse_t ) );
+	uint_t row_offset = layer_neuron_n_offset + sizeof( uint_t ) * ann->layer_n;
+	uint_t column_offset = ann_align( row_offset + sizeof( uint_t ) * ( row_n + 1 ) );
+	uint_t weight_offset = ann_align( column_offset + sizeof( uint_t ) * weight_n );
+	uint_t bias_offset = ann_align( weight_offset + sizeof( fp_t ) * weight_n );
+	uint_t n = bias_offset + sizeof( fp_t ) * row_n;
+
+	// ann_sparse_t | layer_neuron_n[] | row[] | column[] | weight[] | bias[]
+	ann_sparse_t *sparse = ann_malloc( n );
+
+	sparse->n = n;
+	sparse->layer_n = ann->layer_n;
+	sparse->width = width;
+	sparse->weight_n = weight_n;
+	sparse->layer_neuron_n = ( uint_t * ) ( ( uint8_t * ) sparse + layer_neuron_n_offset );
+	sparse->row = ( uint_t * ) ( ( uint8_t * ) sparse + row_offset );
+	sparse->column = ( uint_t * ) ( ( uint8_t * ) sparse + column_offset );
+	sparse->weight = ( fp_t * ) ( ( uint8_t * ) sparse + weight_offset );
+	sparse->bias = ( fp_t * ) ( ( uint8_t * ) sparse + bias_offset );
+	sparse->activation_hidden_type = ann->activation_hidden_type;
+	sparse->activation_output_type = ann->activation_output_type;
+	memcpy( sparse->layer_neuron_n, layer_neuron_n, sizeof( uint_t ) * ann->layer_n );
+
+	w_ij = ann_weight( ann );
+	uint_t r = 0;
+	uint_t k = 0;
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		for( uint_t j = 0; j < layer_neuron_n[l]; j++, r++ )
+		{
+			sparse->row[r] = k;
+
+			for( uint_t i = 0; i < layer_neuron_n[l - 1]; i++ )
+			{
+				if( fabs( w_ij[i] ) > threshold[l] )
+				{
+					sparse->column[k] = i;
+					sparse->weight[k] = w_ij[i];
+					k++;
+				}
+			}
+
+			sparse->bias[r] = w_ij[layer_neuron_n[l - 1]];
+			w_ij += ann_stride( layer_neuron_n[l - 1] );
+		}
+	}
+
+	sparse->row[r] = k;
+
+	return sparse;
+}
+
+
+void ann_sparse_free( ann_sparse_t *sparse )
+{
+	free( sparse );
+}
+
+
+// o_j = s( sum[row_j, row_j+1){ w_k * x_column_k } + b_j )
+
+void ann_sparse_propagation_forward( ann_sparse_t const *sparse, fp_t const *input, fp_t *output )
+{
+	fp_t y[2][sparse->width];
+
+	fp_t const *x = input;
+	uint_t const *row = sparse->row;
+	fp_t const *b_j = sparse->bias;
+
+	for( uint_t l = 1; l < sparse->layer_n; l++ )
+	{
+		fp_t *o_j = ( l == sparse->layer_n - 1 ) ? output : y[l % 2];
+		ann_activation_t activation = ( l == sparse->layer_n - 1 ) ?
+			sparse->activation_output_type :
+			sparse->activation_hidden_type;
+
+		for( uint_t j = 0; j < sparse->layer_neuron_n[l]; j++ )
+		{
+			o_j[j] = ann_dot_sparse( sparse->weight + row[j], sparse->column + row[j], x, row[j + 1] - row[j] ) + b_j[j];
+		}
+
+		ann_activation_forward( activation, o_j, sparse->layer_neuron_n[l] );
+
+		row += sparse->layer_neuron_n[l];
+		b_j += sparse->layer_neuron_n[l];
+		x = o_j;
+	}
+}
+
+
+// The largest absolute difference between the outputs of the pruned network
+// and the network it was built from, over the sample_n inputs in sample
+
+fp_t ann_sparse_error( ann_sparse_t const *sparse, ann_t *ann, fp_t const *sample, uint_t sample_n )
+{
+	uint_t output_n = ann_layer_neuron_n( ann )[ann->layer_n - 1];
+	fp_t expected[output_n], actual[output_n];
+	fp_t error = 0;
+
+	for( uint_t s = 0; s < sample_n; s++ )
+	{
+		ann_propagation_forward( ann, sample + s * ann_layer_neuron_n( ann )[0], expected );
+		ann_sparse_propagation_forward( sparse, sample + s * ann_layer_neuron_n( ann )[0], actual );
+
+		for( uint_t i = 0; i < output_n; i++ )
+		{
+			if( fabs( expected[i] - actual[i] ) > error )
+			{
+				error = fabs( expected[i] - actual[i] );
+			}
+		}
+	}
+
+	return error;
+}
+
+
+// The largest magnitude dropped from layer l, the weights being sorted by
+// magnitude and the first sparsity fraction of them dropped
+
+static fp_t ann_sparse_threshold( ann_t const *ann, uint_t l, fp_t sparsity )
+{
+	uint_t x_n = ann_layer_neuron_n( ann )[l - 1];
+	uint_t y_n = ann_layer_neuron_n( ann )[l];
+	uint_t drop_n = ( uint_t ) ( sparsity * x_n * y_n );
+
+	if( drop_n == 0 )
+	{
+		return 0;
+	}
+
+	fp_t *magnitude = malloc( sizeof( fp_t ) * x_n * y_n );
+	fp_t const *w_ij = ann_weight( ann );
+
+	for( uint_t m = 1; m < l; m++ )
+	{
+		w_ij += ann_layer_neuron_n( ann )[m] * ann_stride( ann_layer_neuron_n( ann )[m - 1] );
+	}
+
+	for( uint_t j = 0; j < y_n; j++ )
+	{
+		for( uint_t i = 0; i < x_n; i++ )
+		{
+			magnitude[j * x_n + i] = fabs( w_ij[i] );
+		}
+
+		w_ij += ann_stride( x_n );
+	}
+
+	qsort( magnitude, x_n * y_n, sizeof( fp_t ), ann_sparse_compare );
+
+	fp_t threshold = magnitude[( drop_n < x_n * y_n ) ? drop_n - 1 : x_n * y_n - 1];
+
+	free( magnitude );
+
+	return threshold;
+}
+
+
+static int ann_sparse_compare( void const *a, void const *b )
+{
+	fp_t x = *( fp_t const * ) a;
+	fp_t y = *( fp_t const * ) b;
+
+	return ( x > y ) - ( x < y );
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HALF PRECISION
+////////////////////////////////////////////////////////////////////////////////
+
+
+// The number of weights in a row of x_n, padded to whole 64 byte lines
+
+static uint_t ann_half_stride( uint_t x_n )
+{
+	return ann_align( sizeof( uint16_t ) * x_n ) / sizeof( uint16_t );
+}
+
+
+// Rounds the weights of a trained network to format. FP16 keeps 11 significant
+// bits over [2^-24, 65504], BF16 keeps 8 over the whole float range.
+
+ann_half_t * ann_half_init( ann_t const *ann, ann_half_format_t format )
+{
+	uint_t const *layer_neuron_n = ann_layer_neuron_n( ann );
+	uint_t row_n = 0;
+	uint_t weight_n = 0;
+	uint_t width = 0;
+
+	for( uint_t l = 0; l < ann->layer_n; l++ )
+	{
+		if( layer_neuron_n[l] > width )
+		{
+			width = layer_neuron_n[l];
+		}
+	}
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		row_n += layer_neuron_n[l];
+		weight_n += layer_neuron_n[l] * ann_half_stride( layer_neuron_n[l - 1] );
+	}
+
+	uint_t layer_neuron_n_offset = ann_align( sizeof( ann_half_t ) );
+	uint_t weight_offset = ann_align( layer_neuron_n_offset + sizeof( uint_t ) * ann->layer_n );
+	uint_t bias_offset = ann_align( weight_offset + sizeof( uint16_t ) * weight_n );
+	uint_t n = bias_offset + sizeof( fp_t ) * row_n;
+
+	// ann_half_t | layer_neuron_n[] | weight[] | bias[]
+	ann_half_t *half = ann_malloc( n );
+
+	half->n = n;
+	half->layer_n = ann->layer_n;
+	half->width = width;
+	half->weight_n = weight_n;
+	half->layer_neuron_n = ( uint_t * ) ( ( uint8_t * ) half + layer_neuron_n_offset );
+	half->format = format;
+	half->weight = ( uint16_t * ) ( ( uint8_t * ) half + weight_offset );
+	half->bias = ( fp_t * ) ( ( uint8_t * ) half + bias_offset );
+	half->activation_hidden_type = ann->activation_hidden_type;
+	half->activation_output_type = ann->activation_output_type;
+	memcpy( half->layer_neuron_n, layer_neuron_n, sizeof( uint_t ) * ann->layer_n );
+
+	fp_t const *w_ij = ann_weight( ann );
+	uint16_t *h_ij = half->weight;
+	fp_t *b_j = half->bias;
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		uint_t x_n = layer_neuron_n[l - 1];
+
+		for( uint_t j = 0; j < layer_neuron_n[l]; j++ )
+		{
+			uint_t i = 0;
+
+			for( ; i < x_n; i++ )
+			{
+				h_ij[i] = ann_half_from_float( ( float ) w_ij[i], format );
+			}
+
+			for( ; i < ann_half_stride( x_n ); i++ )
+			{
+				h_ij[i] = 0;
+			}
+
+			*b_j++ = w_ij[x_n];
+			w_ij += ann_stride( x_n );
+			h_ij += ann_half_stride( x_n );
+		}
+	}
+
+	return half;
+}
+
+
+void ann_half_free( ann_half_t *half )
+{
+	free( half );
+}
+
+
+// o_j = s( sum[1,n]{ h_ij * o_i } + b_j ), the sums taken in float
+
+void ann_half_propagation_forward( ann_half_t const *half, fp_t const *input, fp_t *output )
+{
+	float x_f[half->width];
+	fp_t y[half->width];
+
+	fp_t const *x = input;
+	uint16_t const *w_ij = half->weight;
+	fp_t const *b_j = half->bias;
+
+#ifdef ANN_F16C
+	int f16c = half->format == FP16 && ann_f16c();
+#endif
+
+	for( uint_t l = 1; l < half->layer_n; l++ )
+	{
+		uint_t x_n = half->layer_neuron_n[l - 1];
+		fp_t *o_j = ( l == half->layer_n - 1 ) ? output : y;
+		ann_activation_t activation = ( l == half->layer_n - 1 ) ?
+			half->activation_output_type :
+			half->activation_hidden_type;
+
+		for( uint_t i = 0; i < x_n; i++ )
+		{
+			x_f[i] = ( float ) x[i];
+		}
+
+		for( uint_t j = 0; j < half->layer_neuron_n[l]; j++ )
+		{
+			float s;
+
+#ifdef ANN_F16C
+			if( f16c )
+			{
+				s = ann_dot_fp16_f16c( x_f, w_ij, x_n );
+			}
+			else
+#endif
+			{
+				s = ( half->format == FP16 ) ? ann_dot_fp16( x_f, w_ij, x_n ) : ann_dot_bf16( x_f, w_ij, x_n );
+			}
+
+			o_j[j] = s + *b_j++;
+			w_ij += ann_half_stride( x_n );
+		}
+
+		ann_activation_forward( activation, o_j, half->layer_neuron_n[l] );
+
+		x = o_j;
+	}
+}
+
+
+// The largest absolute difference between the outputs of the half precision
+// network and the network it was built from, over the sample_n inputs in sample
+
+fp_t ann_half_error( ann_half_t const *half, ann_t *ann, fp_t const *sample, uint_t sample_n )
+{
+	uint_t output_n = ann_layer_neuron_n( ann )[ann->layer_n - 1];
+	fp_t expected[output_n], actual[output_n];
+	fp_t error = 0;
+
+	for( uint_t s = 0; s < sample_n; s++ )
+	{
+		ann_propagation_forward( ann, sample + s * ann_layer_neuron_n( ann )[0], expected );
+		ann_half_propagation_forward( half, sample + s * ann_layer_neuron_n( ann )[0], actual );
+
+		for( uint_t i = 0; i < output_n; i++ )
+		{
+			if( fabs( expected[i] - actual[i] ) > error )
+			{
+				error = fabs( expected[i] - actual[i] );
+			}
+		}
+	}
+
+	return error;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// BENCHMARK
+////////////////////////////////////////////////////////////////////////////////
+
+
+// Times repeat_n runs of mode on batches of batch_n samples and reports the
+// cost per sample. Each run repeats the batch for about a millisecond. ann is
+// only read, training runs on a copy with a rate of 0. batch_n and repeat_n
+// must be at least 1.
+//
+// Per sample, the forward pass is a multiply and an add for every weight.
+// Training adds the hidden deltas and the weight update, about two more passes
+// over the weights. The numeric gradient is counted as two forward passes per
+// weight, the cost of plain central differences.
+//
+// The forward pass reads the weights once per batch and writes and reads every
+// activation. Training reads the weights again for the deltas and reads and
+// writes the weights or gradient for every sample.
+
+void ann_benchmark( ann_t const *ann, ann_benchmark_mode_t mode, uint_t batch_n, uint_t repeat_n, ann_benchmark_t *result )
+{
+	assert( batch_n >= 1 && repeat_n >= 1 );
+
+	uint_t const *layer_neuron_n = ann_layer_neuron_n( ann );
+	uint_t input_n = layer_neuron_n[0];
+	uint_t output_n = layer_neuron_n[ann->layer_n - 1];
+
+	// input[] | output[] | target[]
+	fp_t *input = ann_malloc( sizeof( fp_t ) * batch_n * ( input_n + 2 * output_n ) );
+	fp_t *output = input + batch_n * input_n;
+	fp_t *target = output + batch_n * output_n;
+	double *run = malloc( sizeof( double ) * repeat_n );
+	ann_t *copy = ann_copy( ann );
+	ann_checker_t *checker = ( mode == BENCHMARK_NUMERIC ) ? ann_checker_init( copy, 1 ) : NULL;
+
+	// Fixed inputs in [-1, 1] and targets in [0, 1]
+	for( uint_t i = 0; i < batch_n * input_n; i++ )
+	{
+		input[i] = ( fp_t ) ( ( i * 7919 ) % 2001 ) / 1000 - 1;
+	}
+
+	for( uint_t i = 0; i < batch_n * output_n; i++ )
+	{
+		target[i] = ( fp_t ) ( ( i * 104729 ) % 1001 ) / 1000;
+	}
+
+	// Size the runs from a warm up batch
+	double t = ann_time();
+	ann_benchmark_batch( copy, checker, mode, input, output, target, batch_n );
+	t = ann_time() - t;
+
+	uint_t run_batch_n = ( t < 1e-3 ) ? ( uint_t ) ( 1e-3 / ( t + 1e-9 ) ) + 1 : 1;
+
+	for( uint_t r = 0; r < repeat_n; r++ )
+	{
+		t = ann_time();
+
+		for( uint_t b = 0; b < run_batch_n; b++ )
+		{
+			ann_benchmark_batch( copy, checker, mode, input, output, target, batch_n );
+		}
+
+		run[r] = ( ann_time() - t ) * 1e9 / ( ( double ) run_batch_n * batch_n );
+	}
+
+	qsort( run, repeat_n, sizeof( double ), ann_time_compare );
+
+	double forward = 0;
+	double delta = 0;
+	double weight_n = 0;
+	double neuron_n = input_n;
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		forward += 2.0 * layer_neuron_n[l - 1] * layer_neuron_n[l] + layer_neuron_n[l];
+		delta += ( l > 1 ) ? 2.0 * layer_neuron_n[l - 1] * layer_neuron_n[l] : 0;
+		weight_n += ( layer_neuron_n[l - 1] + 1.0 ) * layer_neuron_n[l];
+		neuron_n += layer_neuron_n[l];
+	}
+
+	double weight_byte = ( double ) sizeof( fp_t ) * ann->weight_n;
+	double neuron_byte = 2.0 * sizeof( fp_t ) * neuron_n;
+
+	switch( mode )
+	{
+		case BENCHMARK_FORWARD:
+			result->flop = forward;
+			result->byte = weight_byte / batch_n + neuron_byte;
+			break;
+
+		case BENCHMARK_BACKWARD:
+			result->flop = forward + delta + 2 * weight_n;
+			result->byte = weight_byte / batch_n + 3 * weight_byte + 2 * neuron_byte;
+			break;
+
+		case BENCHMARK_NUMERIC:
+			result->flop = 2 * weight_n * forward;
+			result->byte = 2 * weight_n * ( weight_byte + neuron_byte );
+			break;
+	}
+
+	result->median = ( run[( repeat_n - 1 ) / 2] + run[repeat_n / 2] ) / 2;
+	result->p99 = run[( uint_t ) ceil( 0.99 * repeat_n ) - 1];
+	result->gflops = result->flop / result->median;
+
+	ann_checker_free( checker );
+	ann_free( copy );
+	free( run );
+	free( input );
+}
+
+
+// One batch of the benchmarked work
+
+static void ann_benchmark_batch( ann_t *ann, ann_checker_t *checker, ann_benchmark_mode_t mode, fp_t const *input, fp_t *output, fp_t const *target, uint_t batch_n )
+{
+	uint_t input_n = ann_layer_neuron_n( ann )[0];
+	uint_t output_n = ann_layer_neuron_n( ann )[ann->layer_n - 1];
+
+	switch( mode )
+	{
+		case BENCHMARK_FORWARD:
+			if( batch_n > 1 )
+			{
+				ann_propagation_forward_batch( ann, input, batch_n, output );
+			}
+			else
+			{
+				ann_propagation_forward( ann, input, output );
+			}
+
+			break;
+
+		case BENCHMARK_BACKWARD:
+			if( batch_n > 1 )
+			{
+				ann_train_batch( ann, input, target, batch_n, 0 );
+			}
+			else
+			{
+				ann_propagation_forward( ann, input, output );
+				ann_propagation_backward( ann, input, output, target, 0 );
+			}
+
+			break;
+
+		case BENCHMARK_NUMERIC:
+			for( uint_t b = 0; b < batch_n; b++ )
+			{
+				ann_train_numeric( ann, checker, input + b * input_n, target + b * output_n, 0 );
+			}
+
+			break;
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FILE
+////////////////////////////////////////////////////////////////////////////////
+
+
+// The size of the model part of the block, ann_t | layer_neuron_n[] | weight[]
+
+static uint_t ann_model_size( ann_t const *ann )
+{
+	return ann->weight_offset + sizeof( fp_t ) * ann->weight_n;
+}
+
+
+// Writes the model to path, in native byte order
+//
+// Returns 0 on success and -1 on failure
 
-fp_t ann_error_partial( fp_t o, fp_t t )
+int ann_save( ann_t const *ann, char const *path )
 {
-	return ( o - t );
+	FILE *f = fopen( path, "wb" );
+
+	if( !f )
+	{
+		return -1;
+	}
+
+	uint_t n = ann_model_size( ann );
+	uint_t written = fwrite( ann, 1, n, f );
+
+	if( fclose( f ) != 0 || written != n )
+	{
+		return -1;
+	}
+
+	return 0;
 }
 
 
-// Error Function
-// E = 0.5 * sum_[i=1,n]{ ( o_i - t_i )^2 }
+// Checks that the n bytes at ann hold a model saved by this version at this
+// precision. The counts and offsets of the header must be the layout of its
+// own layer sizes, so a truncated or crafted file is never read past its end.
 
-fp_t ann_error_total( fp_t const *o, fp_t const *t, uint_t n )
+static int ann_model_valid( ann_t const *ann, uint_t n )
 {
-	fp_t error = 0;
-	for( uint_t i = 0; i < n; i++ )
+	ann_t layout;
+
+	// The layer sizes are only read once they are known to be inside the block
+	if( !( n >= sizeof( ann_t ) &&
+		ann->magic == ANN_MAGIC &&
+		ann->version == ANN_VERSION &&
+		ann->fp_n == sizeof( fp_t ) &&
+		ann->activation_hidden_type < SOFTMAX &&
+		ann->activation_output_type <= SOFTMAX &&
+		ann->optimizer <= ADAM &&
+		ann->layer_n >= 2 &&
+		ann->layer_neuron_n_offset == ann_align( sizeof( ann_t ) ) &&
+		ann->layer_neuron_n_offset <= n &&
+		ann->layer_n <= ( n - ann->layer_neuron_n_offset ) / sizeof( uint_t ) ) )
 	{
-		error += ann_error( o[i], t[i] );
+		return 0;
 	}
 
-	return error;
+	return ann_layout( ann->layer_n, ann_layer_neuron_n( ann ), &layout ) == 0 &&
+		ann->n == layout.n &&
+		ann->neuron_n == layout.neuron_n &&
+		ann->weight_n == layout.weight_n &&
+		ann->weight_offset == layout.weight_offset &&
+		ann->neuron_offset == layout.neuron_offset &&
+		ann->delta_offset == layout.delta_offset &&
+		ann->gradient_offset == layout.gradient_offset &&
+		ann->moment_offset == layout.moment_offset &&
+		ann->variance_offset == layout.variance_offset &&
+		ann_model_size( ann ) == n;
+}
+
+
+// Reads a model saved with ann_save() into a new network that can be trained
+//
+// Returns NULL if the file cannot be read or is not a whole model saved by this
+// version at this precision
+
+ann_t * ann_load( char const *path )
+{
+	FILE *f = fopen( path, "rb" );
+
+	if( !f )
+	{
+		return NULL;
+	}
+
+	// The whole file is read and checked as ann_map() checks a mapping, then
+	// copied into a network with its scratch space
+	long n = ( fseek( f, 0, SEEK_END ) == 0 ) ? ftell( f ) : -1;
+	ann_t *model = NULL;
+	ann_t *ann = NULL;
+
+	if( n >= ( long ) sizeof( ann_t ) && ( uint64_t ) n <= UINT32_MAX && fseek( f, 0, SEEK_SET ) == 0 )
+	{
+		model = ann_malloc( n );
+	}
+
+	if( model && fread( model, 1, n, f ) == ( size_t ) n && ann_model_valid( model, n ) )
+	{
+		ann = ann_copy( model );
+	}
+
+	free( model );
+	fclose( f );
+
+	return ann;
+}
+
+
+// Maps a model saved with ann_save() read-only. Nothing is copied, the pages
+// are read on first use and shared through the page cache with every other
+// process mapping the same file.
+//
+// A mapped network has no neuron, delta or gradient space. Propagate it with
+// ann_workspace_forward() and ann_propagation_forward_batch().
+//
+// Returns NULL if the file cannot be mapped or is not a whole model saved by
+// this version at this precision
+
+ann_t const * ann_map( char const *path )
+{
+#if defined( __unix__ )
+	int fd = open( path, O_RDONLY );
+
+	if( fd < 0 )
+	{
+		return NULL;
+	}
+
+	struct stat st;
+	void *map = MAP_FAILED;
+
+	if( fstat( fd, &st ) == 0 && st.st_size >= ( off_t ) sizeof( ann_t ) && st.st_size <= ( off_t ) UINT32_MAX )
+	{
+		map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	}
+
+	close( fd );
+
+	if( map == MAP_FAILED )
+	{
+		return NULL;
+	}
+
+	if( !ann_model_valid( map, st.st_size ) )
+	{
+		munmap( map, st.st_size );
+		return NULL;
+	}
+
+	return map;
+#else
+	return ann_load( path );
+#endif
+}
+
+
+void ann_unmap( ann_t const *ann )
+{
+#if defined( __unix__ )
+	munmap( ( void * ) ann, ann_model_size( ann ) );
+#else
+	ann_free( ( ann_t * ) ann );
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// EXPORT
+////////////////////////////////////////////////////////////////////////////////
+
+
+// Layers with at most this many weights are written fully unrolled, larger
+// ones as loops with constant bounds
+
+#ifndef ANN_EXPORT_UNROLL_N
+#define ANN_EXPORT_UNROLL_N 4096
+#endif
+
+
+// Writes text to f with every $ replaced by the type name fp
+
+static void ann_export_text( FILE *f, char const *text, char const *fp )
+{
+	for( ; *text; text++ )
+	{
+		if( *text == '$' )
+		{
+			fputs( fp, f );
+		}
+		else
+		{
+			fputc( *text, f );
+		}
+	}
+}
+
+
+// The source of an activation as written by ann_export(), $ standing for the
+// type. Kept in step with the ACTIVATION section so the results are identical.
+// SOFTMAX is written by ann_export() itself and IDENTITY has no function.
+
+static char const * ann_export_activation( ann_activation_t activation )
+{
+	switch( activation )
+	{
+		case BINARY:
+			return "static $ activation_binary( $ x )\n{\n\treturn ( x > 0.0 ) ? 1.0 : 0.0;\n}\n";
+
+		case SIGMOID:
+			return "static $ activation_sigmoid( $ x )\n{\n\treturn 1.0 / ( 1.0 + exp( -x ) );\n}\n";
+
+		case RELU:
+			return "static $ activation_relu( $ x )\n{\n\treturn ( x > 0.0 ) ? x : 0.0;\n}\n";
+
+		case ELU:
+			return "static $ activation_elu( $ x )\n{\n\treturn ( x > 0.0 ) ? x : 0.2 * ( expm1( x ) );\n}\n";
+
+		case LRELU:
+			return "static $ activation_lrelu( $ x )\n{\n\treturn ( x > 0.0 ) ? x : 0.2 * x;\n}\n";
+
+		case TANH:
+			return "static $ activation_tanh( $ x )\n{\n\treturn tanh( x );\n}\n";
+
+		case TANH_FAST:
+			return
+				"static $ activation_tanh_fast( $ x )\n"
+				"{\n"
+				"\tconst $ limit = 7.90531110763549805;\n"
+				"\n"
+				"\tx = ( x > limit ) ? limit : ( x < -limit ) ? -limit : x;\n"
+				"\n"
+				"\t$ x2 = x * x;\n"
+				"\t$ p = ( $ ) -2.76076847742355e-16;\n"
+				"\tp = p * x2 + ( $ ) 2.00018790482477e-13;\n"
+				"\tp = p * x2 + ( $ ) -8.60467152213735e-11;\n"
+				"\tp = p * x2 + ( $ ) 5.12229709037114e-08;\n"
+				"\tp = p * x2 + ( $ ) 1.48572235717979e-05;\n"
+				"\tp = p * x2 + ( $ ) 6.37261928875436e-04;\n"
+				"\tp = p * x2 + ( $ ) 4.89352455891786e-03;\n"
+				"\n"
+				"\t$ q = ( $ ) 1.19825839466702e-06;\n"
+				"\tq = q * x2 + ( $ ) 1.18534705686654e-04;\n"
+				"\tq = q * x2 + ( $ ) 2.26843463243900e-03;\n"
+				"\tq = q * x2 + ( $ ) 4.89352518554385e-03;\n"
+				"\n"
+				"\treturn x * p / q;\n"
+				"}\n";
+
+		case SIGMOID_FAST:
+			return
+				"static $ activation_sigmoid_fast( $ x )\n"
+				"{\n"
+				"\treturn ( $ ) 0.5 + ( $ ) 0.5 * activation_tanh_fast( ( $ ) 0.5 * x );\n"
+				"}\n";
+
+		case ELU_FAST:
+			return
+				"static $ activation_elu_fast( $ x )\n"
+				"{\n"
+				"\t$ t = activation_tanh_fast( ( $ ) 0.5 * ( ( x < 0 ) ? x : 0 ) );\n"
+				"\n"
+				"\treturn ( x > 0 ) ? x : ( $ ) 0.2 * 2 * t / ( 1 - t );\n"
+				"}\n";
+
+		default:
+			return NULL;
+	}
+}
+
+
+// Writes y = w_l x + b_l, x_n inputs to y_n outputs, in the order of ann_dot():
+// lane_n sums over the whole vectors added in turn, then the remaining terms
+// and the bias. Every sum starts from 0 so the products contract into FMAs at
+// the same places as in the kernel.
+
+static void ann_export_layer( FILE *f, uint_t l, uint_t x_n, uint_t y_n, char const *x, char const *y, char const *fp )
+{
+#ifdef ANN_VECTOR
+	uint_t lane_n = ANN_LANE_N;
+#else
+	uint_t lane_n = 1;
+#endif
+	uint_t vector_n = x_n / lane_n * lane_n;
+
+	if( x_n * y_n <= ANN_EXPORT_UNROLL_N )
+	{
+		for( uint_t j = 0; j < y_n; j++ )
+		{
+			fprintf( f, "\t%s[%u] = 0", y, j );
+
+			for( uint_t k = 0; k < lane_n && vector_n > 0; k++ )
+			{
+				fprintf( f, "\n\t\t+ ( 0" );
+
+				for( uint_t i = k; i < vector_n; i += lane_n )
+				{
+					fprintf( f, " + %s[%u] * w%u[%u][%u]", x, i, l, j, i );
+				}
+
+				fprintf( f, " )" );
+			}
+
+			for( uint_t i = vector_n; i < x_n; i++ )
+			{
+				fprintf( f, "\n\t\t+ %s[%u] * w%u[%u][%u]", x, i, l, j, i );
+			}
+
+			fprintf( f, "\n\t\t+ w%u[%u][%u];\n", l, j, x_n );
+		}
+
+		return;
+	}
+
+	fprintf( f, "\tfor( int j = 0; j < %u; j++ )\n\t{\n", y_n );
+	fprintf( f, "\t\t%s y_j = 0;\n", fp );
+
+	if( vector_n > 0 )
+	{
+		fprintf( f, "\t\t%s s[%u] = { 0 };\n\n", fp, lane_n );
+		fprintf( f, "\t\tfor( int i = 0; i < %u; i += %u )\n\t\t{\n", vector_n, lane_n );
+		fprintf( f, "\t\t\tfor( int k = 0; k < %u; k++ )\n\t\t\t{\n", lane_n );
+		fprintf( f, "\t\t\t\ts[k] += %s[i + k] * w%u[j][i + k];\n\t\t\t}\n\t\t}\n\n", x, l );
+		fprintf( f, "\t\tfor( int k = 0; k < %u; k++ )\n\t\t{\n", lane_n );
+		fprintf( f, "\t\t\ty_j += s[k];\n\t\t}\n" );
+	}
+
+	// The remaining terms are written out, a loop of them would be vectorized
+	// into separate products and sums
+	fprintf( f, "\n\t\t%s[j] = y_j", y );
+
+	for( uint_t i = vector_n; i < x_n; i++ )
+	{
+		fprintf( f, "\n\t\t\t+ %s[%u] * w%u[j][%u]", x, i, l, i );
+	}
+
+	fprintf( f, "\n\t\t\t+ w%u[j][%u];\n\t}\n", l, x_n );
+}
+
+
+// Writes the network as a standalone C file defining
+//
+//   void name( fp_t const *x, fp_t *y )
+//
+// which evaluates it for the inputs x into the outputs y. The weights become
+// static const arrays, the layer sizes constants and the activations static
+// functions, so the compiler can fold and vectorize the whole network.
+//
+// The sums are taken in the order of ann_dot(), but the AVX2 and AVX-512
+// kernels of ann.h contract them into FMAs while the exported file is built
+// for whatever ISA it is given, so each sum may round differently in its last
+// bits. The outputs agree to within 1e-12 * ( 1 + |y| ) in double and
+// 1e-5 * ( 1 + |y| ) in float, and are identical when both ann.h and the
+// exported file are built with -ffp-contract=off. ann_export_test.c checks
+// both.
+//
+// Returns 0 on success and -1 on failure
+
+int ann_export( ann_t const *ann, char const *path, char const *name )
+{
+	FILE *f = fopen( path, "w" );
+
+	if( !f )
+	{
+		return -1;
+	}
+
+	char const *fp = ( sizeof( fp_t ) < sizeof( double ) ) ? "float" : "double";
+	char const *suffix = ( sizeof( fp_t ) < sizeof( double ) ) ? "f" : "";
+	uint_t const *layer_neuron_n = ann_layer_neuron_n( ann );
+	uint_t l;
+
+	fprintf( f, "// %s.c - exported by ann_export() from a ", name );
+
+	for( l = 0; l < ann->layer_n; l++ )
+	{
+		fprintf( f, ( l > 0 ) ? "-%u" : "%u", layer_neuron_n[l] );
+	}
+
+	fprintf( f, " network\n//\n// void %s( %s const *x, %s *y )\n\n\n#include <tgmath.h>\n\n\n", name, fp, fp );
+
+	// Weights, one row of x_n weights and the bias per neuron
+	fp_t const *w_ij = ann_weight( ann );
+
+	for( l = 1; l < ann->layer_n; l++ )
+	{
+		uint_t x_n = layer_neuron_n[l - 1];
+
+		fprintf( f, "static %s const w%u[%u][%u] =\n{\n", fp, l, layer_neuron_n[l], x_n + 1 );
+
+		for( uint_t j = 0; j < layer_neuron_n[l]; j++ )
+		{
+			fprintf( f, "\t{" );
+
+			for( uint_t i = 0; i < x_n + 1; i++ )
+			{
+				fprintf( f, ( i % 4 == 0 ) ? "\n\t\t%a%s," : " %a%s,", ( double ) w_ij[i], suffix );
+			}
+
+			fprintf( f, "\n\t},\n" );
+			w_ij += ann_stride( x_n );
+		}
+
+		fprintf( f, "};\n\n\n" );
+	}
+
+	// Activations used by the network, each written once. The fast ones call
+	// activation_tanh_fast(), which is written first.
+	int used[SOFTMAX + 1] = { 0 };
+
+	used[ann->activation_output_type] = 1;
+
+	if( ann->layer_n > 2 )
+	{
+		used[ann->activation_hidden_type] = 1;
+	}
+
+	used[TANH_FAST] |= used[SIGMOID_FAST] || used[ELU_FAST];
+
+	if( used[TANH_FAST] )
+	{
+		ann_export_text( f, ann_export_activation( TANH_FAST ), fp );
+		fprintf( f, "\n\n" );
+	}
+
+	for( ann_activation_t a = IDENTITY; a < SOFTMAX; a++ )
+	{
+		if( used[a] && a != TANH_FAST && ann_export_activation( a ) )
+		{
+			ann_export_text( f, ann_export_activation( a ), fp );
+			fprintf( f, "\n\n" );
+		}
+	}
+
+	// As ann_softmax(), with the sum taken over the same lanes as ann_dot()
+	if( used[SOFTMAX] )
+	{
+#ifdef ANN_VECTOR
+		uint_t lane_n = ANN_LANE_N;
+#else
+		uint_t lane_n = 1;
+#endif
+
+		ann_export_text( f,
+			"static void activation_softmax( $ *y, int n )\n"
+			"{\n"
+			"\t$ m = y[0];\n"
+			"\t$ sum = 0;\n", fp );
+		fprintf( f, "\t%s s[%u] = { 0 };\n\tint i;\n\n", fp, lane_n );
+		fprintf( f,
+			"\tfor( i = 1; i < n; i++ )\n"
+			"\t{\n"
+			"\t\tm = ( y[i] > m ) ? y[i] : m;\n"
+			"\t}\n"
+			"\n"
+			"\tfor( i = 0; i + %u <= n; i += %u )\n"
+			"\t{\n"
+			"\t\tfor( int k = 0; k < %u; k++ )\n"
+			"\t\t{\n"
+			"\t\t\ty[i + k] = exp( y[i + k] - m );\n"
+			"\t\t\ts[k] += y[i + k];\n"
+			"\t\t}\n"
+			"\t}\n"
+			"\n"
+			"\tfor( int k = 0; k < %u; k++ )\n"
+			"\t{\n"
+			"\t\tsum += s[k];\n"
+			"\t}\n"
+			"\n"
+			"\tfor( ; i < n; i++ )\n"
+			"\t{\n"
+			"\t\ty[i] = exp( y[i] - m );\n"
+			"\t\tsum += y[i];\n"
+			"\t}\n"
+			"\n", lane_n, lane_n, lane_n, lane_n );
+		ann_export_text( f,
+			"\t$ r = 1 / sum;\n"
+			"\n"
+			"\tfor( i = 0; i < n; i++ )\n"
+			"\t{\n"
+			"\t\ty[i] *= r;\n"
+			"\t}\n"
+			"}\n\n\n", fp );
+	}
+
+	// Forward pass, each hidden layer into its own buffer
+	fprintf( f, "void %s( %s const *x, %s *y )\n{\n", name, fp, fp );
+
+	for( l = 1; l < ann->layer_n - 1; l++ )
+	{
+		fprintf( f, "\t%s h%u[%u];\n", fp, l, layer_neuron_n[l] );
+	}
+
+	for( l = 1; l < ann->layer_n; l++ )
+	{
+		char x[16], y[16];
+		ann_activation_t s = ( l < ann->layer_n - 1 ) ? ann->activation_hidden_type : ann->activation_output_type;
+
+		snprintf( x, sizeof( x ), ( l > 1 ) ? "h%u" : "x", l - 1 );
+		snprintf( y, sizeof( y ), ( l < ann->layer_n - 1 ) ? "h%u" : "y", l );
+
+		fprintf( f, "\n" );
+		ann_export_layer( f, l, layer_neuron_n[l - 1], layer_neuron_n[l], x, y, fp );
+
+		if( s == SOFTMAX )
+		{
+			fprintf( f, "\n\tactivation_softmax( %s, %u );\n", y, layer_neuron_n[l] );
+		}
+		else if( s != IDENTITY )
+		{
+			// The function name is the one written by ann_export_activation()
+			char const *text = ann_export_activation( s ) + strlen( "static $ " );
+
+			fprintf( f, "\n\tfor( int j = 0; j < %u; j++ )\n\t{\n\t\t%s[j] = ", layer_neuron_n[l], y );
+			fwrite( text, 1, strchr( text, '(' ) - text, f );
+			fprintf( f, "( %s[j] );\n\t}\n", y );
+		}
+	}
+
+	fprintf( f, "}\n" );
+
+	int error = ferror( f );
+
+	if( fclose( f ) != 0 || error )
+	{
+		return -1;
+	}
+
+	return 0;
 }
 
 
@@ -550,12 +5533,49 @@ fp_t ann_error_total( fp_t const *o, fp_t const *t, uint_t n )
 ////////////////////////////////////////////////////////////////////////////////
 
 
+// SOFTMAX is only valid for the output layer
+
 void ann_set_activation( ann_t *ann, ann_activation_t activation_hidden, ann_activation_t activation_output )
 {
-	ann->activation_hidden = ACTIVATION[activation_hidden][0];
-	ann->activation_hidden_partial = ACTIVATION[activation_hidden][1];
-	ann->activation_output = ACTIVATION[activation_output][0];
-	ann->activation_output_partial = ACTIVATION[activation_output][1];
+	assert( activation_hidden < SOFTMAX && activation_output <= SOFTMAX );
+
+	ann->activation_hidden_type = activation_hidden;
+	ann->activation_output_type = activation_output;
+}
+
+
+// Selects the optimizer with its usual parameters and clears its state
+//
+// Every network carries moment[] and variance[], two more arrays the size of
+// weight[], whichever optimizer it uses. MOMENTUM uses the first and ADAM both,
+// SGD neither reads nor writes them.
+
+void ann_set_optimizer( ann_t *ann, ann_optimizer_t optimizer )
+{
+	ann->optimizer = optimizer;
+	ann->beta_1 = 0.9;
+	ann->beta_2 = 0.999;
+	ann->epsilon = ( sizeof( fp_t ) < sizeof( double ) ) ? 1e-7 : 1e-8;
+
+	ann_optimizer_clear( ann );
+}
+
+
+// Clears the state of the selected optimizer, only the arrays it uses
+
+static void ann_optimizer_clear( ann_t *ann )
+{
+	ann->step_n = 0;
+
+	if( ann->optimizer != SGD )
+	{
+		memset( ann_moment( ann ), 0, sizeof( fp_t ) * ann->weight_n );
+	}
+
+	if( ann->optimizer == ADAM )
+	{
+		memset( ann_variance( ann ), 0, sizeof( fp_t ) * ann->weight_n );
+	}
 }
 
 
@@ -564,29 +5584,108 @@ void ann_set_activation( ann_t *ann, ann_activation_t activation_hidden, ann_act
 ////////////////////////////////////////////////////////////////////////////////
 
 
+// Weights in [-1, 1] and biases of 0, seeded from rand() so srand() still
+// picks the network
+
 void ann_random( ann_t *ann )
 {
-    uint_t l, j, i;
-    fp_t *wb = ann->weight;
-    for( l = 1; l < ann->layer_n; l++ )
-    {
-        for( j = 0; j < ann->layer_neuron_n[l]; j++ )
-        {
-            i = 0;
-            for( ; i < ann->layer_neuron_n[l - 1]; i++ )
-            {
-                *wb++ = ann_random_range( -1.0, 1.0 );
-            }
+	ann_rng_t rng;
+
+	ann_rng_init( &rng, ( uint64_t ) rand(), 0 );
+	ann_random_init( ann, UNIFORM, &rng );
+}
+
+
+// Draws every weight from the distribution of initializer, fan_in and fan_out
+// being the sizes of the layers either side of it. The biases are set to 0.
+
+void ann_random_init( ann_t *ann, ann_initializer_t initializer, ann_rng_t *rng )
+{
+	fp_t *w_ij = ann_weight( ann );
+
+	for( uint_t l = 1; l < ann->layer_n; l++ )
+	{
+		uint_t x_n = ann_layer_neuron_n( ann )[l - 1];
+		uint_t y_n = ann_layer_neuron_n( ann )[l];
+
+		for( uint_t j = 0; j < y_n; j++ )
+		{
+			switch( initializer )
+			{
+				case UNIFORM:
+					ann_random_uniform( rng, w_ij, x_n, -1, 1 );
+					break;
+
+				case XAVIER:
+					ann_random_uniform( rng, w_ij, x_n, -sqrt( 6.0 / ( x_n + y_n ) ), sqrt( 6.0 / ( x_n + y_n ) ) );
+					break;
+
+				case HE:
+					ann_random_normal( rng, w_ij, x_n, 0, sqrt( 2.0 / x_n ) );
+					break;
+			}
+
+			w_ij[x_n] = 0;
+			w_ij += ann_stride( x_n );
+		}
+	}
+}
+
+
+// x_i ~ U( low, high ), from whole blocks of rng
+//
+// The top 53 ( 24 ) bits of an output make a uniform fp_t in [0, 1)
+
+ANN_SIMD void ann_random_uniform( ann_rng_t *rng, fp_t *x, uint_t n, fp_t low, fp_t high )
+{
+	uint_t shift = ( sizeof( fp_t ) < sizeof( double ) ) ? 40 : 11;
+	fp_t scale = ( high - low ) / ( fp_t ) ( UINT64_C( 1 ) << ( 64 - shift ) );
+	uint64_t y[ANN_RNG_LANE_N];
 
-            *wb++ = 0;
-        }
-    }
+	for( uint_t i = 0; i < n; i += ANN_RNG_LANE_N )
+	{
+		uint_t k_n = ( n - i < ANN_RNG_LANE_N ) ? n - i : ANN_RNG_LANE_N;
+
+		ann_rng_block( rng, y );
+
+		for( uint_t k = 0; k < k_n; k++ )
+		{
+			x[i + k] = low + ( fp_t ) ( int64_t ) ( y[k] >> shift ) * scale;
+		}
+	}
 }
 
 
-static fp_t ann_random_range( fp_t low, fp_t high )
+// x_i ~ N( mean, sd ), by the Box-Muller transform of pairs of uniforms
+//
+// z_0 = sqrt( -2 * log( u_0 ) ) * cos( 2 * PI * u_1 )
+// z_1 = sqrt( -2 * log( u_0 ) ) * sin( 2 * PI * u_1 )
+//
+// u_0 is taken in ( 0, 1 ] so the log stays finite
+
+void ann_random_normal( ann_rng_t *rng, fp_t *x, uint_t n, fp_t mean, fp_t sd )
 {
-	return ( low + ( ( fp_t ) rand() ) * ( high - low ) / RAND_MAX );
+	fp_t u[ANN_RNG_LANE_N];
+
+	for( uint_t i = 0; i < n; i += ANN_RNG_LANE_N )
+	{
+		uint_t k_n = ( n - i < ANN_RNG_LANE_N ) ? n - i : ANN_RNG_LANE_N;
+
+		ann_random_uniform( rng, u, ANN_RNG_LANE_N, 0, 1 );
+
+		for( uint_t k = 0; k < k_n; k += 2 )
+		{
+			fp_t r = sd * sqrt( -2 * log( 1 - u[k] ) );
+			fp_t theta = 2 * ( fp_t ) PI * u[k + 1];
+
+			x[i + k] = mean + r * cos( theta );
+
+			if( k + 1 < k_n )
+			{
+				x[i + k + 1] = mean + r * sin( theta );
+			}
+		}
+	}
 }
 
 
@@ -594,18 +5693,18 @@ void ann_print_neuron( ann_t *ann, fp_t const * const input, fp_t const * const
 {
 	printf( "NEURON:\n\n" );
 
-	for( uint_t i = 0; i < ann->layer_neuron_n[0]; i++ )
+	for( uint_t i = 0; i < ann_layer_neuron_n( ann )[0]; i++ )
 	{
 		fprintf( stderr, "  %+.*f", PRINT_PRECISION, input[i] );
 	}
 
 	fputs( "\n", stderr );
 
-	fp_t *n = ann->neuron;
+	fp_t *n = ann_neuron( ann );
 
 	for( uint_t l = 1; l < ann->layer_n - 1; l++ )
 	{
-		for( uint_t i = 0; i < ann->layer_neuron_n[l]; i++ )
+		for( uint_t i = 0; i < ann_layer_neuron_n( ann )[l]; i++ )
 		{
 			fprintf( stderr, "  %+.*f", PRINT_PRECISION, *n );
 			n++;
@@ -614,7 +5713,7 @@ void ann_print_neuron( ann_t *ann, fp_t const * const input, fp_t const * const
 		fputs( "\n", stderr );
 	}
 
-	for( uint_t i = 0; i < ann->layer_neuron_n[ann->layer_n - 1]; i++ )
+	for( uint_t i = 0; i < ann_layer_neuron_n( ann )[ann->layer_n - 1]; i++ )
 	{
 		fprintf( stderr, "  %+.*f", PRINT_PRECISION, output[i] );
 	}
@@ -627,25 +5726,172 @@ void ann_print_weight( ann_t *ann )
 {
 	fprintf( stderr, "\nWEIGHT | BIAS\n\n" );
 
-	fp_t *weight = ann->weight;
+	fp_t *weight = ann_weight( ann );
 
 	for( uint_t i = 1; i < ann->layer_n; i++ )
 	{
-		for( uint_t j = 0; j < ann->layer_neuron_n[i - 1] + 1; j++ )
+		for( uint_t j = 0; j < ann_layer_neuron_n( ann )[i - 1] + 1; j++ )
 		{
-			for( uint_t k = 0; k < ann->layer_neuron_n[i]; k++ )
+			for( uint_t k = 0; k < ann_layer_neuron_n( ann )[i]; k++ )
 			{
-				fprintf( stderr, "  %+.*f", PRINT_PRECISION, *( weight + j + k * ( ann->layer_neuron_n[i - 1] + 1 ) ) );
+				fprintf( stderr, "  %+.*f", PRINT_PRECISION, *( weight + j + k * ann_stride( ann_layer_neuron_n( ann )[i - 1] ) ) );
 			}
 
 			fputs( "\n", stderr );
 		}
 
-		weight += ann->layer_neuron_n[i - 1] * ann->layer_neuron_n[i] + ann->layer_neuron_n[i];
+		weight += ann_layer_neuron_n( ann )[i] * ann_stride( ann_layer_neuron_n( ann )[i - 1] );
 
 		fputs( "\n", stderr );
 	}
 }
 
 
-#endif // ANN_IMPLEMENTATION
\ No newline at end of file
+#endif // ANN_TEMPLATE_IMPLEMENTATION
+
+
+#undef fp_t
+#undef ann_t
+#undef ann_vector_t
+
+#undef ann_init
+#undef ann_copy
+#undef ann_free
+#undef ann_random
+#undef ann_random_init
+#undef ann_random_uniform
+#undef ann_random_normal
+#undef ann_layer_neuron_n
+#undef ann_weight
+#undef ann_neuron
+#undef ann_delta
+#undef ann_gradient
+#undef ann_moment
+#undef ann_variance
+#undef ann_stride
+#undef ann_save
+#undef ann_load
+#undef ann_map
+#undef ann_unmap
+#undef ann_export
+#undef ann_export_text
+#undef ann_export_activation
+#undef ann_export_layer
+#undef ann_model_size
+#undef ann_layout
+#undef ann_optimizer_clear
+#undef ann_model_valid
+#undef ann_propagation_forward
+#undef ann_propagation_forward_batch
+#undef ann_propagation_backward
+#undef ann_train_numeric
+#undef ann_error_total
+#undef ann_error_cross_entropy
+#undef ann_set_activation
+#undef ann_set_optimizer
+#undef ann_print_weight
+#undef ann_print_neuron
+#undef ann_workspace_t
+#undef ann_workspace_init
+#undef ann_workspace_free
+#undef ann_workspace_forward
+#undef ann_workspace_backward
+#undef ann_checker_t
+#undef ann_checker_init
+#undef ann_checker_free
+#undef ann_checker_gradient
+#undef ann_checker_gradient_pool
+#undef ann_checker_forward
+#undef ann_checker_range
+#undef ann_checker_difference
+#undef ann_checker_task
+#undef ann_error
+#undef ann_error_partial
+#undef ann_activation_binary
+#undef ann_activation_binary_partial
+#undef ann_activation_sigmoid
+#undef ann_activation_sigmoid_partial
+#undef ann_activation_relu
+#undef ann_activation_relu_partial
+#undef ann_activation_elu
+#undef ann_activation_elu_partial
+#undef ann_activation_lrelu
+#undef ann_activation_lrelu_partial
+#undef ann_activation_tanh
+#undef ann_activation_tanh_partial
+#undef ann_activation_sigmoid_fast
+#undef ann_activation_elu_fast
+#undef ann_activation_tanh_fast
+#undef ann_activation_forward
+#undef ann_activation_backward
+#undef ann_dot
+#undef ann_axpy
+#undef ann_dot4
+#undef ann_dot4x2
+#undef ann_axpy4
+#undef ann_ger4
+#undef ann_axpy4_ger4
+#undef ann_update
+#undef ann_update_sgd
+#undef ann_update_momentum
+#undef ann_update_adam
+#undef ann_softmax
+#undef ann_mask_t
+#undef ann_layer_forward
+#undef ann_layer_accumulate
+#undef ann_quant_t
+#undef ann_quant_init
+#undef ann_quant_free
+#undef ann_quant_propagation_forward
+#undef ann_quant_error
+#undef ann_sparse_t
+#undef ann_sparse_init
+#undef ann_sparse_free
+#undef ann_sparse_propagation_forward
+#undef ann_sparse_error
+#undef ann_half_t
+#undef ann_half_init
+#undef ann_half_free
+#undef ann_half_propagation_forward
+#undef ann_half_error
+#undef ann_half_stride
+#undef ann_sparse_threshold
+#undef ann_sparse_compare
+#undef ann_dot_sparse
+#undef ann_benchmark
+#undef ann_benchmark_batch
+#undef ann_train_batch
+#undef ann_gradient_accumulate
+#undef ann_gradient_apply
+#undef ann_propagation_delta
+#undef ann_propagation_delta_output
+#undef ann_propagation_accumulate
+#undef ann_propagation_fused
+#undef ann_trainer_t
+#undef ann_trainer_init
+#undef ann_trainer_free
+#undef ann_trainer_batch
+#undef ann_trainer_accumulate
+#undef ann_propagation_forward_pool
+#undef ann_workspace_forward_pool
+#undef ann_layer_task_t
+#undef ann_layer_task
+#undef ann_loader_t
+#undef ann_loader_init
+#undef ann_loader_free
+#undef ann_loader_next
+#undef ann_loader_read
+#undef ann_loader_thread
+#undef ann_queue_request_t
+#undef ann_queue_t
+#undef ann_queue_init
+#undef ann_queue_free
+#undef ann_queue_submit
+#undef ann_queue_wait
+#undef ann_queue_forward
+#undef ann_queue_stats
+#undef ann_queue_thread
+#undef ann_trainer_reduce
+
+
+#endif // ANN_TEMPLATE
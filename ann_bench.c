@@ -0,0 +1,122 @@
+/*
+MIT License
+
+Copyright (c) 2023 Ethan Werner
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+// ann_bench.c - ann.h benchmark sweep
+//
+//   cc -O2 -o ann_bench ann_bench.c -lm
+//   ./ann_bench [repeat_n] > bench.csv
+//
+// Sweeps depth, width, activation and batch size for the forward pass and for
+// training, plus the numeric gradient on the narrow networks. One CSV row is
+// written to stdout per configuration, the columns being stable so runs from
+// different releases can be compared.
+
+
+#define ANN_IMPLEMENTATION
+#include "ann.h"
+
+
+static char const *MODE[] = { "forward", "backward", "numeric" };
+
+static char const *ACTIVATION[] = {
+	[IDENTITY] = "identity", [BINARY] = "binary", [SIGMOID] = "sigmoid",
+	[RELU] = "relu", [ELU] = "elu", [LRELU] = "lrelu", [TANH] = "tanh",
+	[SIGMOID_FAST] = "sigmoid_fast", [ELU_FAST] = "elu_fast",
+	[TANH_FAST] = "tanh_fast", [SOFTMAX] = "softmax"
+};
+
+
+int main( int argc, char **argv )
+{
+	uint_t repeat_n = ( argc > 1 ) ? ( uint_t ) atoi( argv[1] ) : 21;
+
+	uint_t depth[] = { 1, 2, 4 };
+	uint_t width[] = { 16, 64, 256, 1024 };
+	ann_activation_t activation[] = { RELU, TANH, SIGMOID_FAST };
+	uint_t batch[] = { 1, 8, 64 };
+
+	uint_t input_n = 64;
+	uint_t output_n = 10;
+
+	if( repeat_n == 0 )
+	{
+		return 1;
+	}
+
+	printf( "mode,fp,depth,width,activation,batch,median_ns,p99_ns,gflops,bytes\n" );
+
+	for( uint_t d = 0; d < sizeof( depth ) / sizeof( depth[0] ); d++ )
+	{
+		for( uint_t w = 0; w < sizeof( width ) / sizeof( width[0] ); w++ )
+		{
+			uint_t layer_n = depth[d] + 2;
+			uint_t layer_neuron_n[layer_n];
+
+			layer_neuron_n[0] = input_n;
+			layer_neuron_n[layer_n - 1] = output_n;
+
+			for( uint_t l = 1; l < layer_n - 1; l++ )
+			{
+				layer_neuron_n[l] = width[w];
+			}
+
+			ann_t *ann = ann_init( layer_n, layer_neuron_n );
+			ann_random( ann );
+
+			for( uint_t a = 0; a < sizeof( activation ) / sizeof( activation[0] ); a++ )
+			{
+				ann_set_activation( ann, activation[a], SIGMOID );
+
+				for( ann_benchmark_mode_t mode = BENCHMARK_FORWARD; mode <= BENCHMARK_NUMERIC; mode++ )
+				{
+					for( uint_t b = 0; b < sizeof( batch ) / sizeof( batch[0] ); b++ )
+					{
+						ann_benchmark_t result;
+
+						// The numeric gradient is quadratic in the weights and
+						// has no batched form
+						if( mode == BENCHMARK_NUMERIC && ( width[w] > 64 || batch[b] > 1 ) )
+						{
+							continue;
+						}
+
+						ann_benchmark( ann, mode, batch[b], repeat_n, &result );
+
+						printf( "%s,%u,%u,%u,%s,%u,%.1f,%.1f,%.3f,%.0f\n",
+							MODE[mode], ( uint_t ) ( 8 * sizeof( fp_t ) ), depth[d], width[w],
+							ACTIVATION[activation[a]], batch[b], result.median, result.p99,
+							result.gflops, result.byte );
+
+						fflush( stdout );
+					}
+				}
+			}
+
+			ann_free( ann );
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,239 @@
+/*
+MIT License
+
+Copyright (c) 2023 Ethan Werner
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+// ann_export_test.c - checks ann_export() against ann_propagation_forward()
+//
+//   cc -O2 -o ann_export_test ann_export_test.c -lm -ldl
+//   ./ann_export_test "cc -O2"
+//
+//   cc -O2 -ffp-contract=off -o ann_export_test ann_export_test.c -lm -ldl
+//   ./ann_export_test "cc -O2 -ffp-contract=off" exact
+//
+// Exports networks for every pair of hidden and output activations, in double
+// and float and with both unrolled and looped layers, builds each file with
+// the given compiler command and loads it. The outputs must agree with ann.h
+// to the tolerance stated at ann_export(), or exactly when "exact" is given.
+// Prints one line per failure and returns 1 if there were any.
+
+
+#define ANN_IMPLEMENTATION
+#include "ann.h"
+
+#include <dlfcn.h>
+
+
+#define SAMPLE_N 50
+
+
+static char const *ACTIVATION[] = {
+	[IDENTITY] = "identity", [BINARY] = "binary", [SIGMOID] = "sigmoid",
+	[RELU] = "relu", [ELU] = "elu", [LRELU] = "lrelu", [TANH] = "tanh",
+	[SIGMOID_FAST] = "sigmoid_fast", [ELU_FAST] = "elu_fast",
+	[TANH_FAST] = "tanh_fast", [SOFTMAX] = "softmax"
+};
+
+
+// Builds path.c into path.so and returns its net(), or NULL with the library
+// left unloaded
+
+static void * export_load( char const *cc, char const *path, void **library )
+{
+	char command[1024];
+
+	snprintf( command, sizeof( command ), "%s -shared -fPIC -o %s.so %s.c -lm", cc, path, path );
+
+	if( system( command ) != 0 )
+	{
+		return NULL;
+	}
+
+	snprintf( command, sizeof( command ), "%s.so", path );
+	*library = dlopen( command, RTLD_NOW | RTLD_LOCAL );
+
+	return *library ? dlsym( *library, "net" ) : NULL;
+}
+
+
+// Returns the number of outputs outside the tolerance, or -1 if the exported
+// file didn't build
+
+static int export_check_double( ann_t *ann, char const *cc, char const *path, int exact, ann_rng_t *rng )
+{
+	uint_t input_n = ann_layer_neuron_n( ann )[0];
+	uint_t output_n = ann_layer_neuron_n( ann )[ann->layer_n - 1];
+	double x[input_n], expected[output_n], actual[output_n];
+	char file[1024];
+	void *library;
+	int error_n = 0;
+
+	snprintf( file, sizeof( file ), "%s.c", path );
+
+	if( ann_export( ann, file, "net" ) != 0 )
+	{
+		return -1;
+	}
+
+	void ( *net )( double const *, double * ) = ( void ( * )( double const *, double * ) ) export_load( cc, path, &library );
+
+	if( !net )
+	{
+		return -1;
+	}
+
+	for( uint_t s = 0; s < SAMPLE_N; s++ )
+	{
+		ann_random_uniform( rng, x, input_n, -2, 2 );
+		ann_propagation_forward( ann, x, expected );
+		net( x, actual );
+
+		for( uint_t i = 0; i < output_n; i++ )
+		{
+			double tolerance = exact ? 0 : 1e-12 * ( 1 + fabs( expected[i] ) );
+
+			error_n += !( fabs( expected[i] - actual[i] ) <= tolerance );
+		}
+	}
+
+	dlclose( library );
+
+	return error_n;
+}
+
+
+static int export_check_float( annf_t *ann, char const *cc, char const *path, int exact, ann_rng_t *rng )
+{
+	uint_t input_n = annf_layer_neuron_n( ann )[0];
+	uint_t output_n = annf_layer_neuron_n( ann )[ann->layer_n - 1];
+	float x[input_n], expected[output_n], actual[output_n];
+	char file[1024];
+	void *library;
+	int error_n = 0;
+
+	snprintf( file, sizeof( file ), "%s.c", path );
+
+	if( annf_export( ann, file, "net" ) != 0 )
+	{
+		return -1;
+	}
+
+	void ( *net )( float const *, float * ) = ( void ( * )( float const *, float * ) ) export_load( cc, path, &library );
+
+	if( !net )
+	{
+		return -1;
+	}
+
+	for( uint_t s = 0; s < SAMPLE_N; s++ )
+	{
+		annf_random_uniform( rng, x, input_n, -2, 2 );
+		annf_propagation_forward( ann, x, expected );
+		net( x, actual );
+
+		for( uint_t i = 0; i < output_n; i++ )
+		{
+			float tolerance = exact ? 0 : 1e-5 * ( 1 + fabs( expected[i] ) );
+
+			error_n += !( fabs( expected[i] - actual[i] ) <= tolerance );
+		}
+	}
+
+	dlclose( library );
+
+	return error_n;
+}
+
+
+int main( int argc, char **argv )
+{
+	char const *cc = ( argc > 1 ) ? argv[1] : "cc -O2";
+	int exact = ( argc > 2 ) && strcmp( argv[2], "exact" ) == 0;
+
+	// The first shape is written unrolled, the second has looped layers
+	uint_t unrolled[] = { 20, 37, 13, 4 };
+	uint_t looped[] = { 70, 100, 9 };
+	uint_t *shape[] = { unrolled, looped };
+	uint_t shape_layer_n[] = { 4, 3 };
+
+	char directory[] = "/tmp/ann_export_XXXXXX";
+	char path[256];
+	int fail_n = 0;
+	ann_rng_t rng;
+
+	if( !mkdtemp( directory ) )
+	{
+		return 1;
+	}
+
+	snprintf( path, sizeof( path ), "%s/net", directory );
+	ann_rng_init( &rng, 1, 0 );
+
+	for( uint_t k = 0; k < 2; k++ )
+	{
+		ann_t *ann = ann_init( shape_layer_n[k], shape[k] );
+
+		ann_random_init( ann, XAVIER, &rng );
+
+		// SOFTMAX is output only
+		for( ann_activation_t hidden = IDENTITY; hidden < SOFTMAX; hidden++ )
+		{
+			for( ann_activation_t output = IDENTITY; output <= SOFTMAX; output++ )
+			{
+				ann_set_activation( ann, hidden, output );
+
+				annf_t *annf = ann_to_annf( ann );
+				int error_n[2] = {
+					export_check_double( ann, cc, path, exact, &rng ),
+					export_check_float( annf, cc, path, exact, &rng )
+				};
+
+				for( uint_t p = 0; p < 2; p++ )
+				{
+					if( error_n[p] != 0 )
+					{
+						printf( "%s %s/%s %s: %s\n", ( p == 0 ) ? "double" : "float",
+							ACTIVATION[hidden], ACTIVATION[output], ( k == 0 ) ? "unrolled" : "looped",
+							( error_n[p] < 0 ) ? "build failed" : "outputs differ" );
+						fail_n++;
+					}
+				}
+
+				annf_free( annf );
+			}
+		}
+
+		ann_free( ann );
+	}
+
+	snprintf( path, sizeof( path ), "rm -rf %s", directory );
+
+	if( system( path ) != 0 )
+	{
+		fail_n++;
+	}
+
+	printf( "%d failures\n", fail_n );
+
+	return fail_n > 0;
+}
@@ -0,0 +1,205 @@
+/*
+MIT License
+
+Copyright (c) 2023 Ethan Werner
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+// ann_test.c - checks of ann.h training and propagation
+//
+//   cc -O2 -o ann_test ann_test.c -lm
+//   ./ann_test
+//
+//   cc -O2 -ffp-contract=off -o ann_test ann_test.c -lm
+//   ./ann_test exact
+//
+// The networks have hidden layers of different widths, so a weight row found
+// from the wrong layer's width reads the wrong weights. The batched forward
+// pass must agree with the single one to the tolerance of the register tiled
+// kernels, or exactly when "exact" is given. Prints one line per failure and
+// returns 1 if there were any.
+
+
+#define ANN_IMPLEMENTATION
+#include "ann.h"
+
+
+static uint_t LAYER[] = { 13, 37, 21, 5 };
+
+static char const *ACTIVATION[] = {
+	[IDENTITY] = "identity", [BINARY] = "binary", [SIGMOID] = "sigmoid",
+	[RELU] = "relu", [ELU] = "elu", [LRELU] = "lrelu", [TANH] = "tanh",
+	[SIGMOID_FAST] = "sigmoid_fast", [ELU_FAST] = "elu_fast",
+	[TANH_FAST] = "tanh_fast", [SOFTMAX] = "softmax"
+};
+
+
+// The largest of |x_i - y_i| / ( 1 + |y_i| )
+
+static double test_difference( double const *x, double const *y, uint_t n )
+{
+	double max = 0;
+
+	for( uint_t i = 0; i < n; i++ )
+	{
+		double d = fabs( x[i] - y[i] ) / ( 1 + fabs( y[i] ) );
+
+		max = ( d > max ) ? d : max;
+	}
+
+	return max;
+}
+
+
+// ann_propagation_forward_batch() against ann_propagation_forward() on an odd
+// batch, so both the paired and the single input kernels run
+
+static int test_forward( ann_t *ann, int exact, ann_rng_t *rng )
+{
+	uint_t batch_n = 33;
+	uint_t input_n = LAYER[0];
+	uint_t output_n = LAYER[ann->layer_n - 1];
+	double *x = malloc( sizeof( double ) * batch_n * input_n );
+	double *batch = malloc( sizeof( double ) * batch_n * output_n );
+	double *single = malloc( sizeof( double ) * batch_n * output_n );
+	int fail_n = 0;
+
+	ann_random_uniform( rng, x, batch_n * input_n, -1, 1 );
+	ann_propagation_forward_batch( ann, x, batch_n, batch );
+
+	for( uint_t b = 0; b < batch_n; b++ )
+	{
+		ann_propagation_forward( ann, x + b * input_n, single + b * output_n );
+	}
+
+	if( test_difference( batch, single, batch_n * output_n ) > ( exact ? 0 : 1e-12 ) )
+	{
+		printf( "%s/%s: batch differs from single forward\n",
+			ACTIVATION[ann->activation_hidden_type], ACTIVATION[ann->activation_output_type] );
+		fail_n++;
+	}
+
+	free( single );
+	free( batch );
+	free( x );
+
+	return fail_n;
+}
+
+
+// ann_workspace_backward() against the numeric gradient of ann_checker_t, and
+// the fused SGD step of ann_propagation_backward() against w - rate * dE/dw
+
+static int test_backward( ann_t *ann, ann_rng_t *rng )
+{
+	uint_t input_n = LAYER[0];
+	uint_t output_n = LAYER[ann->layer_n - 1];
+	double x[input_n], t[output_n], y[output_n];
+	double *analytic = calloc( ann->weight_n, sizeof( double ) );
+	double *numeric = calloc( ann->weight_n, sizeof( double ) );
+	double *expected = malloc( sizeof( double ) * ann->weight_n );
+	ann_workspace_t *workspace = ann_workspace_init( ann );
+	ann_checker_t *checker = ann_checker_init( ann, 1 );
+	int fail_n = 0;
+
+	ann_random_uniform( rng, x, input_n, -1, 1 );
+	ann_random_uniform( rng, t, output_n, 0, 1 );
+
+	// The delta y - t of SOFTMAX takes targets that sum to 1
+	if( ann->activation_output_type == SOFTMAX )
+	{
+		uint_t k = ann_rng_next( rng ) % output_n;
+
+		for( uint_t i = 0; i < output_n; i++ )
+		{
+			t[i] = ( i == k );
+		}
+	}
+
+	ann_workspace_forward( ann, workspace, x, y );
+	ann_workspace_backward( ann, workspace, x, y, t, analytic );
+	ann_checker_gradient( checker, x, t, numeric );
+
+	if( test_difference( analytic, numeric, ann->weight_n ) > 1e-6 )
+	{
+		printf( "%s/%s: gradient differs from the numeric gradient\n",
+			ACTIVATION[ann->activation_hidden_type], ACTIVATION[ann->activation_output_type] );
+		fail_n++;
+	}
+
+	for( uint_t i = 0; i < ann->weight_n; i++ )
+	{
+		expected[i] = ann_weight( ann )[i] - 0.1 * analytic[i];
+	}
+
+	ann_set_optimizer( ann, SGD );
+	ann_propagation_forward( ann, x, y );
+	ann_propagation_backward( ann, x, y, t, 0.1 );
+
+	if( test_difference( ann_weight( ann ), expected, ann->weight_n ) > 1e-12 )
+	{
+		printf( "%s/%s: SGD step differs from the gradient\n",
+			ACTIVATION[ann->activation_hidden_type], ACTIVATION[ann->activation_output_type] );
+		fail_n++;
+	}
+
+	ann_checker_free( checker );
+	ann_workspace_free( workspace );
+	free( expected );
+	free( numeric );
+	free( analytic );
+
+	return fail_n;
+}
+
+
+int main( int argc, char **argv )
+{
+	int exact = ( argc > 1 ) && strcmp( argv[1], "exact" ) == 0;
+	// The activations with exact derivatives
+	ann_activation_t hidden[] = { SIGMOID, RELU, ELU, LRELU, TANH };
+	ann_activation_t output[] = { SIGMOID, TANH, SOFTMAX };
+	uint_t layer_n = sizeof( LAYER ) / sizeof( LAYER[0] );
+	int fail_n = 0;
+	ann_rng_t rng;
+
+	ann_rng_init( &rng, 1, 0 );
+
+	for( uint_t h = 0; h < sizeof( hidden ) / sizeof( hidden[0] ); h++ )
+	{
+		for( uint_t o = 0; o < sizeof( output ) / sizeof( output[0] ); o++ )
+		{
+			ann_t *ann = ann_init( layer_n, LAYER );
+
+			ann_random_init( ann, XAVIER, &rng );
+			ann_set_activation( ann, hidden[h], output[o] );
+
+			fail_n += test_forward( ann, exact, &rng );
+			fail_n += test_backward( ann, &rng );
+
+			ann_free( ann );
+		}
+	}
+
+	printf( "%d failures\n", fail_n );
+
+	return fail_n > 0;
+}